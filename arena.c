@@ -0,0 +1,77 @@
+//
+// Created by jmalcy on 12/11/20.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN(size)   (((size) + 15) & ~(size_t)15)
+
+/**
+ * Hands out size bytes, 16 byte aligned, from the newest block or a new one if it's full.
+ * @return The memory, or NULL if a block couldn't be allocated.
+ */
+void *arenaAlloc(arena *a, size_t size) {
+	arenaBlock *block;
+	size_t blockSize;
+
+	size = ARENA_ALIGN(size);
+	if (a->blocks == NULL || a->blocks->size - a->used < size) {
+		blockSize = size > ARENA_BYTES ? size : ARENA_BYTES;
+		if ((block = malloc(sizeof(arenaBlock) + blockSize)) == NULL) {
+			perror("Failed to allocate arena block");
+			return NULL;
+		}
+		block->next = a->blocks;
+		block->size = blockSize;
+		a->blocks = block;
+		a->used = 0;
+	}
+
+	a->last = a->blocks->data + a->used;
+	a->used += size;
+	return a->last;
+}
+
+/**
+ * Makes ptr, allocated from a with oldSize bytes, newSize bytes long. It grows where it is if nothing was allocated
+ * after it and the block has room, otherwise it's copied somewhere that does.
+ * @param ptr NULL to just allocate.
+ * @return The memory, or NULL if it couldn't be grown, in which case ptr is left as it was.
+ */
+void *arenaGrow(arena *a, void *ptr, size_t oldSize, size_t newSize) {
+	char *grown;
+
+	if (ptr == NULL)
+		return arenaAlloc(a, newSize);
+	if (ptr == a->last && (size_t)(a->last - a->blocks->data) + ARENA_ALIGN(newSize) <= a->blocks->size) {
+		a->used = a->last - a->blocks->data + ARENA_ALIGN(newSize);
+		return ptr;
+	}
+
+	if ((grown = arenaAlloc(a, newSize)) == NULL)
+		return NULL;
+	memcpy(grown, ptr, oldSize < newSize ? oldSize : newSize);
+	return grown;
+}
+
+// forgets everything allocated from a, only the first block is kept to be filled again
+void arenaReset(arena *a) {
+	arenaBlock *block;
+
+	while (a->blocks != NULL && a->blocks->next != NULL) {
+		block = a->blocks;
+		a->blocks = block->next;
+		free(block);
+	}
+	a->used = 0;
+	a->last = NULL;
+}
+
+void arenaFree(arena *a) {
+	arenaReset(a);
+	free(a->blocks);
+	a->blocks = NULL;
+}
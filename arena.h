@@ -0,0 +1,36 @@
+//
+// Created by jmalcy on 12/11/20.
+//
+
+#ifndef HTTPPROXY_ARENA_H
+#define HTTPPROXY_ARENA_H
+
+#include <stddef.h>
+#include "macro.h"
+
+typedef struct arenaBlock {
+	struct arenaBlock *next;  // the block filled before this one
+	size_t size;  // bytes of data
+	char data[] __attribute__((aligned(16)));
+} arenaBlock;
+
+/**
+ * Bump allocator for what a request needs while it's being served. Nothing is freed on its own, the whole arena is
+ * rewound once the request is done. The first block is kept for the next request, so a connection only goes to malloc
+ * once however many requests it carries, unless one of them needs more than ARENA_BYTES.
+ */
+typedef struct {
+	arenaBlock *blocks;  // newest first, the oldest is the one kept across resets
+	size_t used;  // bytes of the newest block handed out
+	char *last;  // the most recent allocation, the only one arenaGrow() can extend in place
+} arena;
+
+void *arenaAlloc(arena *a, size_t size);
+
+void *arenaGrow(arena *a, void *ptr, size_t oldSize, size_t newSize);
+
+void arenaReset(arena *a);
+
+void arenaFree(arena *a);
+
+#endif //HTTPPROXY_ARENA_H
@@ -0,0 +1,190 @@
+//
+// Created by jmalcy on 11/30/20.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "blacklist.h"
+
+// djb2 of the lowercased name, host names don't care about case
+static unsigned long hostHash(const char *host) {
+	unsigned long h = 5381;
+
+	while (*host)
+		h = h * 33 + (unsigned char)tolower(*host++);
+	return h;
+}
+
+static int insertHost(struct blacklist *blacklist, const char *host) {
+	int i = (int)(hostHash(host) & (blacklist->hostSlots - 1));
+
+	while (blacklist->hosts[i] != NULL) {
+		if (strcasecmp(blacklist->hosts[i], host) == 0)
+			return 0;
+		i = (i + 1) & (blacklist->hostSlots - 1);
+	}
+	if ((blacklist->hosts[i] = strdup(host)) == NULL)
+		return -1;
+	blacklist->hostCount++;
+	return 0;
+}
+
+static int insertPrefix(struct blacklist *blacklist, struct in_addr addr, int length) {
+	uint32_t bits = ntohl(addr.s_addr);
+	cidrNode *node;
+	int depth, bit;
+
+	if (blacklist->root == NULL && (blacklist->root = calloc(1, sizeof(cidrNode))) == NULL)
+		return -1;
+
+	for (node = blacklist->root, depth = 0; depth < length; depth++) {
+		bit = (bits >> (31 - depth)) & 1;
+		if (node->children[bit] == NULL && (node->children[bit] = calloc(1, sizeof(cidrNode))) == NULL)
+			return -1;
+		node = node->children[bit];
+	}
+	node->terminal = 1;
+	blacklist->prefixCount++;
+	return 0;
+}
+
+// "a.b.c.d" or "a.b.c.d/length", anything else is taken to be a host name
+static int parsePrefix(char *line, struct in_addr *addr, int *length) {
+	char *slash = strchr(line, '/');
+	int parsed;
+
+	if (slash != NULL)
+		*slash = '\0';
+	parsed = inet_pton(AF_INET, line, addr) == 1;
+	*length = 32;
+	if (slash != NULL) {
+		*slash = '/';
+		*length = atoi(slash + 1);
+		if (!isdigit(slash[1]) || *length < 0 || *length > 32)
+			parsed = 0;
+	}
+	return parsed;
+}
+
+/**
+ * Compiles a blacklist file, one host name, IPv4 address or IPv4 CIDR prefix per line. Blank lines and lines starting
+ * with # are skipped. A missing file makes an empty blacklist.
+ * @return The blacklist, or NULL if it couldn't be allocated.
+ */
+struct blacklist *loadBlacklist(const char *fileName) {
+	struct blacklist *blacklist;
+	char lineBuf[MAXLINE], *line, *end;
+	char **names = NULL, **grown;
+	int nameCount = 0, nameCapacity = 0, length, i, failed = 0;
+	struct in_addr addr;
+	FILE *file;
+
+	if ((blacklist = calloc(1, sizeof(struct blacklist))) == NULL) {
+		perror("Failed to allocate blacklist");
+		return NULL;
+	}
+
+	// prefixes go straight into the trie, names are collected first so the set can be sized for them
+	if ((file = fopen(fileName, "r")) != NULL) {
+		while (!failed && fgets(lineBuf, MAXLINE, file)) {
+			for (line = lineBuf; isspace(*line); line++);
+			for (end = line + strlen(line); end > line && isspace(end[-1]); end--);
+			*end = '\0';
+			if (*line == '\0' || *line == '#')
+				continue;
+
+			if (parsePrefix(line, &addr, &length)) {
+				failed = insertPrefix(blacklist, addr, length) < 0;
+				continue;
+			}
+
+			if (nameCount == nameCapacity) {
+				nameCapacity = nameCapacity == 0 ? 16 : nameCapacity * 2;
+				if ((grown = realloc(names, sizeof(char *) * nameCapacity)) == NULL) {
+					failed = 1;
+					continue;
+				}
+				names = grown;
+			}
+			if ((names[nameCount] = strdup(line)) == NULL)
+				failed = 1;
+			else
+				nameCount++;
+		}
+		fclose(file);
+	}
+
+	// at most half full
+	for (blacklist->hostSlots = 16; blacklist->hostSlots < nameCount * 2; blacklist->hostSlots *= 2);
+	if (!failed && (blacklist->hosts = calloc(blacklist->hostSlots, sizeof(char *))) == NULL)
+		failed = 1;
+	for (i = 0; i < nameCount; i++) {
+		if (!failed && insertHost(blacklist, names[i]) < 0)
+			failed = 1;
+		free(names[i]);
+	}
+	free(names);
+
+	if (failed) {
+		perror("Failed to load blacklist");
+		freeBlacklist(blacklist);
+		return NULL;
+	}
+	return blacklist;
+}
+
+int blacklistedHost(const struct blacklist *blacklist, const char *host) {
+	int i;
+
+	if (host == NULL || blacklist->hostCount == 0)
+		return 0;
+
+	for (i = (int)(hostHash(host) & (blacklist->hostSlots - 1)); blacklist->hosts[i] != NULL;
+			i = (i + 1) & (blacklist->hostSlots - 1)) {
+		if (strcasecmp(blacklist->hosts[i], host) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// walks the trie along addr's bits, any prefix ending on the way covers it
+int blacklistedAddress(const struct blacklist *blacklist, struct in_addr addr) {
+	uint32_t bits = ntohl(addr.s_addr);
+	const cidrNode *node = blacklist->root;
+	int depth = 0;
+
+	while (node != NULL) {
+		if (node->terminal)
+			return 1;
+		if (depth == 32)
+			break;
+		node = node->children[(bits >> (31 - depth)) & 1];
+		depth++;
+	}
+	return 0;
+}
+
+static void freeNode(cidrNode *node) {
+	if (node == NULL)
+		return;
+	freeNode(node->children[0]);
+	freeNode(node->children[1]);
+	free(node);
+}
+
+void freeBlacklist(struct blacklist *blacklist) {
+	int i;
+
+	if (blacklist == NULL)
+		return;
+	for (i = 0; blacklist->hosts != NULL && i < blacklist->hostSlots; i++)
+		free(blacklist->hosts[i]);
+	free(blacklist->hosts);
+	freeNode(blacklist->root);
+	free(blacklist);
+}
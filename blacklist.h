@@ -0,0 +1,37 @@
+//
+// Created by jmalcy on 11/30/20.
+//
+
+#ifndef HTTPPROXY_BLACKLIST_H
+#define HTTPPROXY_BLACKLIST_H
+
+#include <netinet/in.h>
+#include "macro.h"
+
+// one bit of an IPv4 prefix, a prefix ends at a terminal node
+typedef struct cidrNode {
+	struct cidrNode *children[2];
+	int terminal;
+} cidrNode;
+
+/**
+ * The blacklist file compiled into a hash set of host names and a binary trie of IPv4 prefixes. It is never changed
+ * once built, a reload builds a new one and swaps the pointer, so checks need no locking.
+ */
+struct blacklist {
+	char **hosts;  // open addressing with linear probing, hostSlots is a power of two
+	int hostSlots;
+	int hostCount;
+	cidrNode *root;
+	int prefixCount;
+};
+
+struct blacklist *loadBlacklist(const char *fileName);
+
+int blacklistedHost(const struct blacklist *blacklist, const char *host);
+
+int blacklistedAddress(const struct blacklist *blacklist, struct in_addr addr);
+
+void freeBlacklist(struct blacklist *blacklist);
+
+#endif //HTTPPROXY_BLACKLIST_H
@@ -4,6 +4,8 @@
 
 #include "cache.h"
 #include "md5.h"
+#include "journal.h"
+#include "keyhash.h"
 #include "macro.h"
 #include <stdio.h>
 #include <errno.h>
@@ -12,18 +14,108 @@
 #include <pthread.h>
 #include <math.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <linux/limits.h>
 
-struct cache *initCache(int timeout) {
+static void *reapExpired(void *vCache);
+
+static void warmStart(struct cache *cache);
+
+static void compactJournal(struct cacheShard *shard);
+
+static int lookupShard(const uint8_t *key, struct cacheShard *shard, int lockEnabled, int wantMemory, cacheHit *hit);
+
+// sets up shard i of a cache whose directory exists, returns -1 if its table or directory can't be made
+/**
+ * Puts the path of name, with suffix after it, in shard's directory into path, which holds PATH_MAX bytes.
+ * @return 0, or -1 if it doesn't fit.
+ */
+static int shardPath(char *path, const struct cacheShard *shard, const char *name, const char *suffix) {
+	int length = snprintf(path, PATH_MAX, "%s/%s%s", shard->directory, name, suffix);
+	return length < 0 || length >= PATH_MAX ? -1 : 0;
+}
+
+static int initShard(struct cacheShard *shard, int i, struct cache *cache) {
+	int length;
+
+	bzero(shard, sizeof(struct cacheShard));
+	shard->cache = cache;
+	shard->capacity = INITIAL_CACHE_SLOTS;
+	shard->wheelTime = time(NULL);
+	shard->journalfd = -1;
+
+	// every file the shard will hold has to fit, the longest being a .part one
+	length = snprintf(shard->directory, PATH_MAX, "%s/%02x", cache->cacheDirectory, i);
+	if (length < 0 || length + 1 + HEX_BYTES + strlen(".part") >= PATH_MAX ||
+			shardPath(shard->journalFile, shard, "index.log", "") < 0) {
+		fprintf(stderr, "Cache directory path too long: %s\n", cache->cacheDirectory);
+		return -1;
+	}
+
+	if (mkdir(shard->directory, 0755) < 0 && errno != EEXIST) {
+		perror("Failed to create cache shard directory");
+		return -1;
+	}
+
+	// cache index allocation, every slot starts out empty
+	if ((shard->slots = calloc(shard->capacity, sizeof(cacheEntry *))) == NULL ||
+			(shard->wheel = calloc(WHEEL_SLOTS, sizeof(cacheEntry *))) == NULL) {
+		perror("Failed to allocate in-memory cache");
+		free(shard->slots);
+		return -1;
+	}
+	pthread_rwlock_init(&shard->lock, NULL);
+	pthread_mutex_init(&shard->inflightMutex, NULL);
+	return 0;
+}
+
+// tears down the first count shards, removing their files unless the cache is persistent
+static void freeShards(struct cache *cache, int count) {
+	char fullName[PATH_MAX];
+	struct cacheShard *shard;
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		shard = &cache->shards[i];
+
+		// a persistent directory keeps its files and log for the next start
+		if (shard->journalfd >= 0)
+			close(shard->journalfd);
+
+		for (j = 0; j < shard->capacity; j++) {
+			if (shard->slots[j] == NULL)
+				continue;
+
+			if (!cache->persistent && shardPath(fullName, shard, shard->slots[j]->requestHash, "") == 0)
+				remove(fullName);
+			freeCacheEntry(shard->slots[j]);
+		}
+		if (!cache->persistent)
+			rmdir(shard->directory);
+
+		pthread_rwlock_destroy(&shard->lock);
+		pthread_mutex_destroy(&shard->inflightMutex);
+		free(shard->wheel);
+		free(shard->slots);
+	}
+}
+
+/**
+ * @param directory Where to keep the cache so it outlives the proxy, created if missing and warm started from if it
+ * already holds one. NULL for a fresh temporary directory.
+ */
+struct cache *initCache(int timeout, int staleGrace, size_t memoryBudget, const char *directory) {
 	// temp dir initialization
-	int initialCacheCapacity = 1;
-	const char *dirStr = "/tmp/proxyCache.XXXXXX", *cacheFileName = "/dnsCache.csv";
+	const char *dirStr = directory != NULL ? directory : "/tmp/proxyCache.XXXXXX", *cacheFileName = "/dnsCache.csv";
 
 	char *tmpDir = NULL, *tmpTemplate = malloc(strlen(dirStr) + 1), *hostnameTemplate = NULL;
 
-	pthread_mutex_t *mutex, *hostnameMutex;
-	cacheEntry **array;
 	struct cache *newCache;
+	int i;
 
 	// Memory allocation check failures
 	if (tmpTemplate == NULL) {
@@ -40,7 +132,15 @@ struct cache *initCache(int timeout) {
 
 	strcpy(tmpTemplate, dirStr);
 
-	if ((tmpDir = mkdtemp(tmpTemplate)) == NULL) {
+	if (directory != NULL) {
+		if (mkdir(tmpTemplate, 0755) < 0 && errno != EEXIST) {
+			perror("Failed to create cache directory");
+			free(tmpTemplate);
+			free(hostnameTemplate);
+			return NULL;
+		}
+		tmpDir = tmpTemplate;
+	} else if ((tmpDir = mkdtemp(tmpTemplate)) == NULL) {
 		perror("Failed to create cache directory");
 		free(tmpTemplate);
 		free(hostnameTemplate);
@@ -50,215 +150,957 @@ struct cache *initCache(int timeout) {
 	strcpy(hostnameTemplate, tmpDir);
 	strcat(hostnameTemplate, cacheFileName);
 
-	// memory allocation for mutex
-	if ((mutex = malloc(sizeof(pthread_mutex_t))) == NULL) {
-		perror("Failed to allocate memory for cache mutex");
+	// cache struct allocation
+	if ((newCache = calloc(1, sizeof(struct cache))) == NULL) {
+		perror("Failed to allocate cache struct");
 		free(tmpTemplate);
 		free(hostnameTemplate);
-		return NULL;
-	}
-	pthread_mutex_init(mutex, NULL);
 
-	if ((hostnameMutex = malloc(sizeof(pthread_mutex_t))) == NULL) {
-		perror("Failed to allocate memory for cache mutex");
-		free(tmpTemplate);
-		free(hostnameTemplate);
-		pthread_mutex_destroy(mutex);
-		free(mutex);
 		return NULL;
 	}
-	pthread_mutex_init(hostnameMutex, NULL);
 
-	// cache array allocation
-	if ((array = malloc(sizeof(cacheEntry *) * initialCacheCapacity)) == NULL) {
-		perror("Failed to allocate in-memory cache");
-		free(tmpTemplate);
-		free(hostnameTemplate);
-		pthread_mutex_destroy(mutex);
-		pthread_mutex_destroy(hostnameMutex);
-		free(mutex);
-		free(hostnameMutex);
+	/**
+	 * Finally! If we get to this point then all of the memory allocations passed.
+	 * They will probaby always passed on a non-embedded system, but it's still nice to have the checks in place.
+	 * Now we build the actual struct that we're going to return.
+	 */
+	newCache->dnsFile = hostnameTemplate;
+	newCache->cacheDirectory = tmpDir;
+	newCache->timeout = timeout;
+	newCache->staleGrace = staleGrace;
+	newCache->persistent = directory != NULL;
 
-		return NULL;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		if (initShard(&newCache->shards[i], i, newCache) < 0) {
+			freeShards(newCache, i);
+			free(newCache);
+			free(tmpTemplate);
+			free(hostnameTemplate);
+			return NULL;
+		}
 	}
+	pthread_mutex_init(&newCache->reaperMutex, NULL);
+	pthread_cond_init(&newCache->reaperCond, NULL);
+	slabInit(&newCache->memory, memoryBudget);
 
-	// cache struct allocation
-	if ((newCache = malloc(sizeof(struct cache))) == NULL) {
-		perror("Failed to allocate cache struct");
+	if (newCache->persistent)
+		warmStart(newCache);
+	else
+		setKeyHash(KEY_HASH, randomKeySeed());
+
+	if (pthread_create(&newCache->reaper, NULL, reapExpired, newCache) != 0) {
+		perror("Failed to start cache reaper");
+		freeShards(newCache, CACHE_SHARDS);
+		pthread_mutex_destroy(&newCache->reaperMutex);
+		pthread_cond_destroy(&newCache->reaperCond);
+		slabDestroy(&newCache->memory);
+		free(newCache);
 		free(tmpTemplate);
 		free(hostnameTemplate);
-		pthread_mutex_destroy(mutex);
-		pthread_mutex_destroy(hostnameMutex);
-		free(mutex);
-		free(hostnameMutex);
-		free(array);
 
 		return NULL;
 	}
 
-	/**
-	 * Finally! If we get to this point then all of the memory allocations passed.
-	 * They will probaby always passed on a non-embedded system, but it's still nice to have the checks in place.
-	 * Now we build the actual struct that we're going to return.
-	 */
-	 newCache->array = array;
-	 newCache->mutex = mutex;
-	 newCache->hostnameMutex = hostnameMutex;
-	 newCache->dnsFile = hostnameTemplate;
-	 newCache->cacheDirectory = tmpDir;
-	 newCache->count = 0;
-	 newCache->capacity = initialCacheCapacity;
-	 newCache->timeout = timeout;
-
-	fprintf(stderr, "Cache diretory is %s\n", tmpDir);
+	fprintf(stderr, "Cache directory is %s\n", tmpDir);
 	return newCache;
 }
 
-void addToCache(char *requestHash, struct cache *cache) {
+// home slot of a key. Key hashes are uniform, so their leading bytes are already a good hash
+static int slotOf(const uint8_t *key, int capacity) {
+	uint64_t h;
+	memcpy(&h, key, sizeof(h));
+	return (int)(h & (uint64_t)(capacity - 1));
+}
+
+// the shard a key lives in, picked by bytes slotOf() doesn't look at so every shard's table is evenly spread
+static struct cacheShard *shardOf(const uint8_t *key, struct cache *cache) {
+	return &cache->shards[key[DIGEST_BYTES - 1] & (CACHE_SHARDS - 1)];
+}
+
+// index of key's slot, or -1 if it isn't in the table. Caller holds shard->lock.
+static int findSlot(const uint8_t *key, struct cacheShard *shard) {
+	int i = slotOf(key, shard->capacity);
+
+	while (shard->slots[i] != NULL) {
+		if (memcmp(shard->slots[i]->key, key, DIGEST_BYTES) == 0)
+			return i;
+		i = (i + 1) & (shard->capacity - 1);
+	}
+	return -1;
+}
+
+// places an entry known not to be in the table. Caller holds shard->lock exclusively.
+static void insertSlot(cacheEntry *cEntry, cacheEntry **slots, int capacity) {
+	int i = slotOf(cEntry->key, capacity);
+
+	while (slots[i] != NULL)
+		i = (i + 1) & (capacity - 1);
+	slots[i] = cEntry;
+}
+
+// doubles the table once it passes 3/4 full. Caller holds shard->lock exclusively.
+static int growTable(struct cacheShard *shard) {
+	int i, newCapacity = shard->capacity * 2;
+	cacheEntry **newSlots;
+
+	if ((newSlots = calloc(newCapacity, sizeof(cacheEntry *))) == NULL) {
+		perror("Failed to grow cache index");
+		return -1;
+	}
+
+	for (i = 0; i < shard->capacity; i++) {
+		if (shard->slots[i] != NULL)
+			insertSlot(shard->slots[i], newSlots, newCapacity);
+	}
+
+	free(shard->slots);
+	shard->slots = newSlots;
+	shard->capacity = newCapacity;
+	return 0;
+}
+
+/**
+ * Empties slot i and shifts any following entries of the same probe run back into the gap, so lookups never need
+ * tombstones. Caller holds shard->lock exclusively.
+ */
+static void removeSlot(int i, struct cacheShard *shard) {
+	int mask = shard->capacity - 1, j = i, home;
+
+	shard->slots[i] = NULL;
+	while (1) {
+		j = (j + 1) & mask;
+		if (shard->slots[j] == NULL)
+			break;
+
+		// entry at j can move into the gap if its home slot isn't cyclically within (i, j]
+		home = slotOf(shard->slots[j]->key, shard->capacity);
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			shard->slots[i] = shard->slots[j];
+			shard->slots[j] = NULL;
+			i = j;
+		}
+	}
+	shard->count--;
+}
+
+/**
+ * Files an entry under the bucket of its expiry second. One already due goes in the next bucket the reaper looks at,
+ * rather than one it has just passed and won't come back to for a full turn. Caller holds shard->lock exclusively.
+ */
+static void wheelInsert(cacheEntry *cEntry, struct cacheShard *shard) {
+	cacheEntry **bucket;
+
+	if (cEntry->removeAt <= shard->wheelTime)
+		cEntry->removeAt = shard->wheelTime + 1;
+	bucket = &shard->wheel[cEntry->removeAt & (WHEEL_SLOTS - 1)];
+	cEntry->wheelPrev = NULL;
+	cEntry->wheelNext = *bucket;
+	if (*bucket != NULL)
+		(*bucket)->wheelPrev = cEntry;
+	*bucket = cEntry;
+}
+
+// unlinks an entry from its wheel bucket. Caller holds shard->lock exclusively.
+static void wheelRemove(cacheEntry *cEntry, struct cacheShard *shard) {
+	if (cEntry->wheelPrev != NULL)
+		cEntry->wheelPrev->wheelNext = cEntry->wheelNext;
+	else
+		shard->wheel[cEntry->removeAt & (WHEEL_SLOTS - 1)] = cEntry->wheelNext;
+	if (cEntry->wheelNext != NULL)
+		cEntry->wheelNext->wheelPrev = cEntry->wheelPrev;
+	cEntry->wheelNext = cEntry->wheelPrev = NULL;
+}
+
+// drops a reference to an in-memory object, handing its chunk back once nobody is left
+void releaseMemoryObject(memoryObject *memory) {
+	if (__atomic_sub_fetch(&memory->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		slabFree(memory->allocator, memory, memory->sizeClass);
+}
+
+// links an entry into its size class's CLOCK ring just behind the hand. Caller holds shard->lock exclusively.
+static void clockInsert(cacheEntry *cEntry, struct cacheShard *shard) {
+	cacheEntry **hand = &shard->clockHands[cEntry->memory->sizeClass];
+
+	if (*hand == NULL) {
+		cEntry->clockNext = cEntry->clockPrev = cEntry;
+		*hand = cEntry;
+	} else {
+		cEntry->clockNext = *hand;
+		cEntry->clockPrev = (*hand)->clockPrev;
+		(*hand)->clockPrev->clockNext = cEntry;
+		(*hand)->clockPrev = cEntry;
+	}
+	cEntry->referenced = 0;
+	shard->clockCounts[cEntry->memory->sizeClass]++;
+}
+
+// takes an entry out of the in-memory tier, its file stays. Caller holds shard->lock exclusively.
+static void dropFromMemory(cacheEntry *cEntry, struct cacheShard *shard) {
+	int sizeClass;
+
+	if (cEntry->memory == NULL)
+		return;
+
+	sizeClass = cEntry->memory->sizeClass;
+	if (cEntry->clockNext == cEntry) {
+		shard->clockHands[sizeClass] = NULL;
+	} else {
+		if (shard->clockHands[sizeClass] == cEntry)
+			shard->clockHands[sizeClass] = cEntry->clockNext;
+		cEntry->clockPrev->clockNext = cEntry->clockNext;
+		cEntry->clockNext->clockPrev = cEntry->clockPrev;
+	}
+	shard->clockCounts[sizeClass]--;
+
+	releaseMemoryObject(cEntry->memory);  // replies still sending from it keep it alive
+	cEntry->memory = NULL;
+	cEntry->clockNext = cEntry->clockPrev = NULL;
+}
+
+/**
+ * Sweeps the CLOCK hand of one size class until it finds a victim: an object that hasn't been hit since the hand last
+ * passed and that no reply is sending from. Caller holds shard->lock exclusively.
+ * @return 0 if something was evicted, -1 if everything in the class is in use.
+ */
+static int evictFromMemory(int sizeClass, struct cacheShard *shard) {
+	int steps;
+	cacheEntry *cEntry;
+
+	for (steps = 0; steps < shard->clockCounts[sizeClass] * 2; steps++) {
+		cEntry = shard->clockHands[sizeClass];
+		shard->clockHands[sizeClass] = cEntry->clockNext;
+
+		if (__atomic_exchange_n(&cEntry->referenced, 0, __ATOMIC_RELAXED))
+			continue;  // second chance
+		if (__atomic_load_n(&cEntry->memory->refs, __ATOMIC_ACQUIRE) > 1)
+			continue;  // pinned by a reply
+
+		dropFromMemory(cEntry, shard);
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * Evicts from the other shards' rings of a size class, for a shard whose own ring has nothing left to give. The budget
+ * is shared, so a chunk freed anywhere will do. Their locks are only tried, never waited on, since two shards doing
+ * this for each other would otherwise deadlock. Caller holds shard->lock exclusively.
+ * @return 0 if something was evicted, -1 if nothing could be.
+ */
+static int evictFromOtherShards(int sizeClass, struct cacheShard *shard) {
+	struct cache *cache = shard->cache;
+	struct cacheShard *other;
+	int i, evicted = -1;
+
+	for (i = 1; i < CACHE_SHARDS && evicted < 0; i++) {
+		other = &cache->shards[(shard - cache->shards + i) % CACHE_SHARDS];
+		if (pthread_rwlock_trywrlock(&other->lock) != 0)
+			continue;
+		evicted = evictFromMemory(sizeClass, other);
+		pthread_rwlock_unlock(&other->lock);
+	}
+	return evicted;
+}
+
+/**
+ * Copies a small object's file into a slab chunk, evicting colder objects of the same size class if the budget is
+ * spent, from this shard first and then from the others. Objects too big for any class, or that can't find room, are
+ * served from disk only. Caller holds shard->lock exclusively.
+ */
+static void admitToMemory(cacheEntry *cEntry, int fd, off_t size, struct cacheShard *shard) {
+	int sizeClass;
+	memoryObject *memory;
+
+	if (fd < 0 || size <= 0 || (sizeClass = slabClass(sizeof(memoryObject) + size)) < 0)
+		return;
+
+	while ((memory = slabAlloc(&shard->cache->memory, sizeClass)) == NULL) {
+		if (evictFromMemory(sizeClass, shard) < 0 && evictFromOtherShards(sizeClass, shard) < 0)
+			return;
+	}
+
+	if (pread(fd, memory->data, size, 0) != size) {
+		slabFree(&shard->cache->memory, memory, sizeClass);
+		return;
+	}
+	memory->refs = 1;
+	memory->sizeClass = sizeClass;
+	memory->length = size;
+	memory->allocator = &shard->cache->memory;
+
+	cEntry->memory = memory;
+	clockInsert(cEntry, shard);
+}
+
+// whether the destination can be asked if an expired copy is still good instead of sending it again
+static int revalidatable(const cacheEntry *cEntry) {
+	return cEntry->validators.etag[0] != '\0' || cEntry->validators.lastModified[0] != '\0';
+}
+
+// kept through its grace window, and for longer if it can be revalidated once that's over
+static time_t removalTime(const cacheEntry *cEntry) {
+	time_t keep = cEntry->expires + (revalidatable(cEntry) ? STALE_KEEP_SECONDS : 0);
+	return keep > cEntry->staleUntil ? keep : cEntry->staleUntil;
+}
+
+// fresh for maxAge seconds from now and servable stale for staleGrace after that, the cache's defaults for -1
+static void setExpiry(cacheEntry *cEntry, long maxAge, long staleGrace, struct cacheShard *shard) {
+	cEntry->t = time(NULL);
+	cEntry->expires = cEntry->t + (maxAge >= 0 ? maxAge : shard->cache->timeout);
+	cEntry->staleGrace = staleGrace;
+	cEntry->staleUntil = cEntry->expires + (staleGrace >= 0 ? staleGrace : shard->cache->staleGrace);
+	cEntry->removeAt = removalTime(cEntry);
+}
+
+// notes a change to the index in a persistent directory's log. Caller holds shard->lock exclusively.
+static void journal(int type, const cacheEntry *cEntry, struct cacheShard *shard) {
+	if (shard->journalfd >= 0 && appendJournal(shard->journalfd, type, cEntry) == 0)
+		shard->journalRecords++;
+}
+
+/**
+ * Indexes a freshly fetched object. If partialName is given that file is renamed into place under the same lock, so a
+ * file with the final name always belongs to the entry in the index. Small objects are also copied from fd into the
+ * in-memory tier.
+ */
+void addToCache(const uint8_t *key, const char *requestHash, const char *partialName, int fd, off_t size, int framed,
+		const cacheValidators *validators, long maxAge, long staleGrace, struct cache *cache) {
 	// error check
-	if (requestHash == NULL || cache == NULL)
+	if (key == NULL || requestHash == NULL || cache == NULL)
 		return;
 
-	// first, check to see if entry is already in the cache
-	FILE *lookupResult;
+	struct cacheShard *shard = shardOf(key, cache);
+	int i;
+	char fileName[PATH_MAX];
+	pthread_rwlock_wrlock(&shard->lock);
 
-	// try doing cache lookup on md5 result
-	pthread_mutex_lock(cache->mutex);
+	if (partialName != NULL) {
+		if (shardPath(fileName, shard, requestHash, "") < 0 || rename(partialName, fileName) < 0) {
+			perror("Failed to move fetched file into the cache");
+			pthread_rwlock_unlock(&shard->lock);
+			return;
+		}
+	}
 
-	// File is already in the cache, ignore and leave
-	if ((lookupResult = cacheLookup(requestHash, cache, LOCK_DISABLED)) != NULL) {
-		fclose(lookupResult);
-		pthread_mutex_unlock(cache->mutex);
+	// File is already in the cache. It was just rewritten, so restart its clock.
+	if ((i = findSlot(key, shard)) >= 0) {
+		wheelRemove(shard->slots[i], shard);
+		shard->slots[i]->size = size;
+		shard->slots[i]->framed = framed;
+		shard->slots[i]->validators = *validators;
+		setExpiry(shard->slots[i], maxAge, staleGrace, shard);
+		wheelInsert(shard->slots[i], shard);
+		journal(JOURNAL_ADD, shard->slots[i], shard);
+		dropFromMemory(shard->slots[i], shard);
+		admitToMemory(shard->slots[i], fd, size, shard);
+		pthread_rwlock_unlock(&shard->lock);
 		return;
 	}
 
-	// second: Didn't find file in cache, time to add it.
+	// Didn't find file in cache, time to add it.
 	cacheEntry *cEntry;
 	if ((cEntry = malloc(sizeof(cacheEntry))) == NULL) {
 		perror("Failed cacheEntry malloc during addToCache");
 
-		pthread_mutex_unlock(cache->mutex);
+		pthread_rwlock_unlock(&shard->lock);
 		return;
 	}
-	cEntry->requestHash = requestHash;
-	cEntry->t = time(NULL);
+	memcpy(cEntry->key, key, DIGEST_BYTES);
+	strncpy(cEntry->requestHash, requestHash, HEX_BYTES);
+	cEntry->requestHash[HEX_BYTES] = '\0';
+	cEntry->size = size;
+	cEntry->framed = framed;
+	cEntry->validators = *validators;
+	setExpiry(cEntry, maxAge, staleGrace, shard);
+	cEntry->memory = NULL;
+	cEntry->referenced = 0;
+	cEntry->clockNext = cEntry->clockPrev = NULL;
 
-	// do we have to double cache size to fit new entry?
-	if (cache->count == cache->capacity) {
-		cache->capacity *= 2;
-
-		cache->array = (cacheEntry **)realloc(cache->array, sizeof(cacheEntry *) * cache->capacity);
+	// keep the load factor under 3/4 so probe runs stay short
+	if ((shard->count + 1) * 4 > shard->capacity * 3 && growTable(shard) < 0) {
+		free(cEntry);
+		pthread_rwlock_unlock(&shard->lock);
+		return;
 	}
 
-	// Add element to cache, increase the count
-	cache->array[cache->count++] = cEntry;
+	insertSlot(cEntry, shard->slots, shard->capacity);
+	wheelInsert(cEntry, shard);
+	admitToMemory(cEntry, fd, size, shard);
+	journal(JOURNAL_ADD, cEntry, shard);
+	shard->count++;
 
-	pthread_mutex_unlock(cache->mutex);
-	pthread_t id;
-	struct destructionArgs *dArgs = malloc(sizeof(struct destructionArgs));
-	dArgs->cEntry = cEntry;
-	dArgs->c = cache;
-	dArgs->doDetach = 1;
-	pthread_create(&id, NULL, deleteCacheEntry, (void *)dArgs);
+	pthread_rwlock_unlock(&shard->lock);
 }
 
-FILE *cacheLookup(char *requestHash, struct cache *cache, int lockEnabled) {
+/**
+ * Looks key up in the index.
+ * @param wantMemory Whether a hit may be served from the in-memory tier. If it is, hit->memory is set with a reference
+ * the caller must give back with releaseMemoryObject(), otherwise hit->fd is a descriptor on the cached file. An
+ * expired object inside its grace window is a hit too, with hit->stale set.
+ * @return 0 on a hit, -1 on a miss.
+ */
+int cacheLookup(const uint8_t *key, struct cache *cache, int lockEnabled, int wantMemory, cacheHit *hit) {
 	// error check
-	if (requestHash == NULL || cache == NULL)
-		return NULL;
+	if (key == NULL || cache == NULL)
+		return -1;
 
-	int i;
-	FILE *returnValue = NULL;
-	char fileName[PATH_MAX];  // one for / one for \0
+	return lookupShard(key, shardOf(key, cache), lockEnabled, wantMemory, hit);
+}
+
+// cacheLookup() once the key's shard is known
+static int lookupShard(const uint8_t *key, struct cacheShard *shard, int lockEnabled, int wantMemory, cacheHit *hit) {
+	int i, returnValue = -1;
+	char fileName[PATH_MAX];
+	cacheEntry *cEntry;
+	time_t now = time(NULL);
+
+	hit->fd = -1;
+	hit->memory = NULL;
+	hit->framed = 0;
+	hit->stale = 0;
 
 	if (lockEnabled == LOCK_ENABLED)
-		pthread_mutex_lock(cache->mutex);
+		pthread_rwlock_rdlock(&shard->lock);
 
-	// First, check if requestHash in cache. Second, open cache file if possible.
-	for(i = 0; i < cache->count && returnValue == NULL && !errno; i++) {
-		if (strcmp(requestHash, cache->array[i]->requestHash) == 0) {  // found in cache, try to open file
-			sprintf(fileName, "%s/%s", cache->cacheDirectory, requestHash);
-			returnValue = fopen(fileName, "r");
+	// First, check if key is in the index and still fresh or in its grace window. Second, serve it from memory or
+	// open its file. The file is opened under the lock so it can't be removed out from under us. Entries past their
+	// grace window are misses even if the reaper hasn't gotten to them yet.
+	if ((i = findSlot(key, shard)) >= 0 && (cEntry = shard->slots[i])->staleUntil > now) {
+		hit->framed = cEntry->framed;
+		hit->stale = cEntry->expires <= now;
+		if (wantMemory && cEntry->memory != NULL) {
+			__atomic_add_fetch(&cEntry->memory->refs, 1, __ATOMIC_ACQ_REL);
+			__atomic_store_n(&cEntry->referenced, 1, __ATOMIC_RELAXED);
+			hit->memory = cEntry->memory;
+			returnValue = 0;
+		} else {
+			if (shardPath(fileName, shard, cEntry->requestHash, "") == 0 && (hit->fd = open(fileName, O_RDONLY)) >= 0)
+				returnValue = 0;
 		}
 	}
 
 	if (lockEnabled == LOCK_ENABLED)
-		pthread_mutex_unlock(cache->mutex);
+		pthread_rwlock_unlock(&shard->lock);
 
 	return returnValue;
 }
 
-void * deleteCacheEntry(void *dArgs) {
-	int i, foundIndex = -1;
-	struct destructionArgs *destArgs = (struct destructionArgs *)dArgs;
-	struct cache *cache = destArgs->c;
-	cacheEntry *cEntry = destArgs->cEntry;
-
-	if (destArgs -> doDetach == 1)
-		pthread_detach(pthread_self());
+// bucket of the in-flight table a key chains from
+static inflightFetch **inflightBucket(const uint8_t *key, struct cacheShard *shard) {
+	return &shard->inflight[slotOf(key, INFLIGHT_SLOTS)];
+}
 
-	free(destArgs);
-	sleep(cache->timeout);
-	pthread_mutex_lock(cache->mutex);
+// a leader about to fetch: hands it the expired copy of the object, if there's one that can be revalidated
+static void findStale(inflightFetch *fetch, struct cacheShard *shard) {
+	char fileName[PATH_MAX];
+	cacheEntry *cEntry;
+	int i;
 
-	// get index of cache entry.
-	for(i = 0; i < cache->count && foundIndex == -1; i++) {
-		if (strcmp(cEntry->requestHash, cache->array[i]->requestHash) == 0) {
-			// found cache element!
-			foundIndex = i;
+	pthread_rwlock_rdlock(&shard->lock);
+	if ((i = findSlot(fetch->key, shard)) >= 0 && revalidatable(cEntry = shard->slots[i])) {
+		if (shardPath(fileName, shard, cEntry->requestHash, "") == 0 &&
+				(fetch->staleFd = open(fileName, O_RDONLY)) >= 0) {
+			fetch->staleFramed = cEntry->framed;
+			fetch->staleLifetime = cEntry->expires - cEntry->t;
+			fetch->staleWindow = cEntry->staleGrace;
+			fetch->staleValidators = cEntry->validators;
 		}
 	}
+	pthread_rwlock_unlock(&shard->lock);
+}
 
-	// didn't find it.
-	if (foundIndex == -1) {
-		pthread_mutex_unlock(cache->mutex);
+/**
+ * Puts a new fetch of key in the in-flight table with a fresh .part file to download into, and the expired copy to
+ * revalidate in its staleFd if there is one. Caller holds shard->inflightMutex and has checked nobody is fetching key.
+ * @param fd Set to a descriptor the caller owns on the .part file.
+ * @return The fetch, or NULL on error.
+ */
+static inflightFetch *startFetch(const uint8_t *key, const char *requestHash, struct cacheShard *shard, int *fd) {
+	inflightFetch *f, **bucket = inflightBucket(key, shard);
+
+	if ((f = calloc(1, sizeof(inflightFetch))) == NULL) {
+		perror("Failed to allocate in-flight fetch");
+		return NULL;
+	}
+	memcpy(f->key, key, DIGEST_BYTES);
+	strncpy(f->requestHash, requestHash, HEX_BYTES);
+	if (shardPath(f->partialName, shard, requestHash, ".part") < 0) {
+		fprintf(stderr, "Cache file path too long in %s\n", shard->directory);
+		free(f);
 		return NULL;
 	}
+	f->state = FETCH_RUNNING;
+	f->refs = 1;
+	f->shard = shard;
+	f->maxAge = -1;
+	f->staleGrace = -1;
+	f->storable = 1;
+	f->staleFd = -1;
 
-	// shift cache
-	for (i = foundIndex; i < cache->count - 1; i++)
-		cache->array[i] = cache->array[i + 1];
+	// read-write so the leader's client can be fed from the file while the rest is still arriving
+	if ((f->fd = open(f->partialName, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || (*fd = dup(f->fd)) < 0) {
+		perror("failed opening new cache file");
+		if (f->fd >= 0) {
+			close(f->fd);
+			remove(f->partialName);
+		}
+		free(f);
+		return NULL;
+	}
 
-	// removed entry
-	cache->array[cache->count--] = NULL;
+	findStale(f, shard);
+	f->next = *bucket;
+	*bucket = f;
+	return f;
+}
+
+/**
+ * Called on an index miss. If somebody is already fetching key the caller follows along with them, otherwise the caller
+ * becomes the leader and gets a fresh .part file to download into. Because the index is checked again under the
+ * in-flight lock, a fetch that finished since the caller's lookup shows up as a hit rather than a second download.
+ * @param waiter Registered with the fetch when the caller becomes a follower.
+ * @param fetch Set to the fetch for leaders and followers, who must hand it back with leaveFetch(). A leader finds the
+ * expired copy it may revalidate in its staleFd.
+ * @param hit Filled in like cacheLookup() on a hit, otherwise hit->fd is a descriptor the caller owns on the file being
+ * fetched.
+ * @return FETCH_HIT, FETCH_LEADER or FETCH_FOLLOWER, or -1 on error.
+ */
+int joinFetch(const uint8_t *key, const char *requestHash, struct cache *cache, fetchWaiter *waiter,
+		inflightFetch **fetch, cacheHit *hit) {
+	struct cacheShard *shard = shardOf(key, cache);
+	inflightFetch *f, **bucket = inflightBucket(key, shard);
+
+	*fetch = NULL;
+	pthread_mutex_lock(&shard->inflightMutex);
+
+	for (f = *bucket; f != NULL; f = f->next) {
+		if (memcmp(f->key, key, DIGEST_BYTES) == 0)
+			break;
+	}
+
+	if (f != NULL) {  // somebody beat us to it, read along
+		hit->memory = NULL;
+		if ((hit->fd = dup(f->fd)) < 0) {
+			pthread_mutex_unlock(&shard->inflightMutex);
+			return -1;
+		}
+		f->refs++;
+		waiter->waiting = 0;
+		waiter->next = f->waiters;
+		f->waiters = waiter;
+		*fetch = f;
+		pthread_mutex_unlock(&shard->inflightMutex);
+		return FETCH_FOLLOWER;
+	}
 
-	pthread_mutex_unlock(cache->mutex);
+	if (lookupShard(key, shard, LOCK_ENABLED, 1, hit) == 0) {
+		pthread_mutex_unlock(&shard->inflightMutex);
+		return FETCH_HIT;
+	}
+
+	hit->memory = NULL;
+	*fetch = startFetch(key, requestHash, shard, &hit->fd);
+	pthread_mutex_unlock(&shard->inflightMutex);
+	return *fetch != NULL ? FETCH_LEADER : -1;
+}
+
+/**
+ * Called on a stale hit. Unless somebody is already fetching key, or it was refreshed since the caller's lookup, the
+ * caller becomes the leader of a fetch that no client waits on, so only one refresh of a popular object ever runs and
+ * everyone else keeps being served the stale copy until it lands.
+ * @param fetch Set to the fetch when the caller leads it, to be handed back with leaveFetch().
+ * @param fd Set to a descriptor the caller owns on the file being fetched.
+ * @return FETCH_LEADER, FETCH_RUNNING if there's nothing to do, or -1 on error.
+ */
+int refreshFetch(const uint8_t *key, const char *requestHash, struct cache *cache, inflightFetch **fetch, int *fd) {
+	struct cacheShard *shard = shardOf(key, cache);
+	inflightFetch *f;
+	cacheEntry *cEntry;
+	int i, fresh;
+
+	*fetch = NULL;
+	pthread_mutex_lock(&shard->inflightMutex);
 
+	for (f = *inflightBucket(key, shard); f != NULL; f = f->next) {
+		if (memcmp(f->key, key, DIGEST_BYTES) == 0) {
+			pthread_mutex_unlock(&shard->inflightMutex);
+			return FETCH_RUNNING;
+		}
+	}
+
+	pthread_rwlock_rdlock(&shard->lock);
+	fresh = (i = findSlot(key, shard)) >= 0 && (cEntry = shard->slots[i])->expires > time(NULL);
+	pthread_rwlock_unlock(&shard->lock);
+	if (fresh) {
+		pthread_mutex_unlock(&shard->inflightMutex);
+		return FETCH_RUNNING;
+	}
+
+	*fetch = startFetch(key, requestHash, shard, fd);
+	pthread_mutex_unlock(&shard->inflightMutex);
+	return *fetch != NULL ? FETCH_LEADER : -1;
+}
+
+// wakes every waiter that has caught up. Caller holds shard->inflightMutex.
+static void wakeWaiters(inflightFetch *fetch) {
+	fetchWaiter *waiter;
+	uint64_t one = 1;
+	int lastfd = -1;
+
+	for (waiter = fetch->waiters; waiter != NULL; waiter = waiter->next) {
+		if (!waiter->waiting)
+			continue;
+		waiter->waiting = 0;
+
+		// waiters on the same worker tend to be next to each other, one wakeup covers all of them
+		if (waiter->notifyfd != lastfd && write(waiter->notifyfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("Failed to wake fetch waiter");
+		lastfd = waiter->notifyfd;
+	}
+}
+
+// leader: another available bytes of the file are in place
+void publishFetch(inflightFetch *fetch, off_t available) {
+	pthread_mutex_lock(&fetch->shard->inflightMutex);
+	fetch->available = available;
+	wakeWaiters(fetch);
+	pthread_mutex_unlock(&fetch->shard->inflightMutex);
+}
+
+/**
+ * Follower: how far along is the fetch. If the caller has already sent everything there is, it's marked as waiting so
+ * the next publishFetch() wakes its worker.
+ * @param sent Bytes the caller has already sent on.
+ * @param available Set to the bytes of the file the caller may send.
+ * @return The fetch's state.
+ */
+int followFetch(inflightFetch *fetch, fetchWaiter *waiter, off_t sent, off_t *available) {
+	int state;
+
+	pthread_mutex_lock(&fetch->shard->inflightMutex);
+	*available = fetch->available;
+	state = fetch->state;
+	if (state == FETCH_RUNNING && sent >= fetch->available)
+		waiter->waiting = 1;
+	pthread_mutex_unlock(&fetch->shard->inflightMutex);
+
+	return state;
+}
+
+/**
+ * Leader: the fetch is over. A complete object is renamed into place and indexed before the fetch leaves the in-flight
+ * table, so there is no moment where a new requester finds neither.
+ * @param state FETCH_DONE, FETCH_FAILED or FETCH_FORBIDDEN.
+ */
+void finishFetch(inflightFetch *fetch, int state) {
+	struct cacheShard *shard = fetch->shard;
+	inflightFetch **link;
+	fetchWaiter *waiter;
+
+	if (state == FETCH_DONE && fetch->storable)
+		addToCache(fetch->key, fetch->requestHash, fetch->partialName, fetch->fd, fetch->available, fetch->framed,
+				&fetch->validators, fetch->maxAge, fetch->staleGrace, shard->cache);
+	else
+		remove(fetch->partialName);  // readers still have it open
+
+	pthread_mutex_lock(&shard->inflightMutex);
+	for (link = inflightBucket(fetch->key, shard); *link != NULL; link = &(*link)->next) {
+		if (*link == fetch) {
+			*link = fetch->next;
+			break;
+		}
+	}
+	fetch->state = state;
+
+	// everybody needs to hear about this one, caught up or not
+	for (waiter = fetch->waiters; waiter != NULL; waiter = waiter->next)
+		waiter->waiting = 1;
+	wakeWaiters(fetch);
+	pthread_mutex_unlock(&shard->inflightMutex);
+}
+
+// drops the caller's interest in a fetch, freeing it once nobody is left
+void leaveFetch(inflightFetch *fetch, fetchWaiter *waiter) {
+	struct cacheShard *shard = fetch->shard;
+	fetchWaiter **link;
+	int refs;
+
+	pthread_mutex_lock(&shard->inflightMutex);
+	for (link = &fetch->waiters; waiter != NULL && *link != NULL; link = &(*link)->next) {
+		if (*link == waiter) {
+			*link = waiter->next;
+			break;
+		}
+	}
+	refs = --fetch->refs;
+	pthread_mutex_unlock(&shard->inflightMutex);
+
+	if (refs == 0) {
+		close(fetch->fd);
+		if (fetch->staleFd >= 0)
+			close(fetch->staleFd);
+		free(fetch);
+	}
+}
+
+/**
+ * Sweeps one shard's wheel buckets for the seconds that have passed, pulls every expired entry out of its index and
+ * removes their files as one batch under a single lock acquisition.
+ */
+static void reapShard(struct cacheShard *shard, time_t now) {
+	cacheEntry *cEntry, *next, *expired = NULL;
 	char fullName[PATH_MAX];
-	bzero(fullName, PATH_MAX);
-	snprintf(fullName, PATH_MAX, "%s/%s", cache->cacheDirectory, cEntry->requestHash);
+	time_t second;
+	int i;
+
+	pthread_rwlock_wrlock(&shard->lock);
 
-	freeCacheEntry(cEntry);
+	// a full turn covers every bucket, no need to go around more than once after a long stall
+	second = shard->wheelTime + 1;
+	if (now - shard->wheelTime > WHEEL_SLOTS)
+		second = now - WHEEL_SLOTS + 1;
+
+	for (; second <= now; second++) {
+		for (cEntry = shard->wheel[second & (WHEEL_SLOTS - 1)]; cEntry != NULL; cEntry = next) {
+			next = cEntry->wheelNext;
+			if (cEntry->removeAt > now)  // belongs to a later turn of the wheel
+				continue;
+
+			wheelRemove(cEntry, shard);
+			dropFromMemory(cEntry, shard);
+			if ((i = findSlot(cEntry->key, shard)) >= 0)
+				removeSlot(i, shard);
+			cEntry->wheelNext = expired;
+			expired = cEntry;
+		}
+	}
+	shard->wheelTime = now;
+
+	// unlink while still holding the lock so a refetch of the same key can't be added and then lose its file
+	for (cEntry = expired; cEntry != NULL; cEntry = cEntry->wheelNext) {
+		if (shardPath(fullName, shard, cEntry->requestHash, "") == 0)
+			remove(fullName);
+		journal(JOURNAL_REMOVE, cEntry, shard);
+	}
+
+	// keep the log from growing without bound, it only needs to describe what's indexed now
+	if (shard->journalfd >= 0 && shard->journalRecords > JOURNAL_COMPACT_RATIO * (long)(shard->count + INITIAL_CACHE_SLOTS))
+		compactJournal(shard);
+	pthread_rwlock_unlock(&shard->lock);
+
+	for (cEntry = expired; cEntry != NULL; cEntry = next) {
+		next = cEntry->wheelNext;
+		freeCacheEntry(cEntry);
+	}
+}
+
+// Reaper thread. Once a second it sweeps every shard in turn, each only holds up its own lookups while it's swept.
+static void *reapExpired(void *vCache) {
+	struct cache *cache = (struct cache *)vCache;
+	struct timespec wakeup;
+	time_t now;
+	int i;
+
+	pthread_mutex_lock(&cache->reaperMutex);
+	while (!cache->stopReaper) {
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += 1;
+		pthread_cond_timedwait(&cache->reaperCond, &cache->reaperMutex, &wakeup);
+		if (cache->stopReaper)
+			break;
+
+		now = time(NULL);
+		for (i = 0; i < CACHE_SHARDS; i++)
+			reapShard(&cache->shards[i], now);
+	}
+	pthread_mutex_unlock(&cache->reaperMutex);
 
-	remove(fullName);
 	return NULL;
 }
 
+/**
+ * Rewrites the index log to one record per entry and reopens it. If that fails the old log is kept, it's longer than
+ * it needs to be but still right. Caller holds shard->lock exclusively, or is initCache().
+ */
+static void compactJournal(struct cacheShard *shard) {
+	int written = rewriteJournal(shard->journalFile, shard->slots, shard->capacity);
+
+	if (written < 0 && shard->journalfd >= 0)
+		return;
+	if (shard->journalfd >= 0)
+		close(shard->journalfd);
+	shard->journalfd = openJournal(shard->journalFile);
+	shard->journalRecords = written > 0 ? written : 0;
+}
+
+// replays one index log record into the table
+static void restoreRecord(const journalRecord *record, void *vShard) {
+	struct cacheShard *shard = (struct cacheShard *)vShard;
+	char fileName[PATH_MAX];
+	struct stat fileStat;
+	cacheEntry *cEntry;
+	int i;
+
+	// whatever was known about the key before is superseded
+	if ((i = findSlot(record->key, shard)) >= 0) {
+		cEntry = shard->slots[i];
+		wheelRemove(cEntry, shard);
+		removeSlot(i, shard);
+		freeCacheEntry(cEntry);
+	}
+	if (record->type != JOURNAL_ADD)
+		return;
+
+	if ((cEntry = calloc(1, sizeof(cacheEntry))) == NULL) {
+		perror("Failed cacheEntry malloc during warm start");
+		return;
+	}
+	memcpy(cEntry->key, record->key, DIGEST_BYTES);
+	digestStr(cEntry->key, cEntry->requestHash);
+
+	// a file that's gone or doesn't match what was logged, say after a crash, isn't trusted
+	if (shardPath(fileName, shard, cEntry->requestHash, "") < 0 || stat(fileName, &fileStat) < 0 ||
+			fileStat.st_size != record->size) {
+		free(cEntry);
+		return;
+	}
+	cEntry->t = record->t;
+	cEntry->expires = record->expires;
+	cEntry->staleGrace = record->staleGrace;
+	cEntry->staleUntil = cEntry->expires + (cEntry->staleGrace >= 0 ? cEntry->staleGrace : shard->cache->staleGrace);
+	cEntry->size = record->size;
+	cEntry->framed = record->framed;
+	cEntry->validators = record->validators;
+	cEntry->removeAt = removalTime(cEntry);
+	if (cEntry->removeAt <= time(NULL)) {
+		free(cEntry);
+		return;
+	}
+
+	if ((shard->count + 1) * 4 > shard->capacity * 3 && growTable(shard) < 0) {
+		free(cEntry);
+		return;
+	}
+	insertSlot(cEntry, shard->slots, shard->capacity);
+	wheelInsert(cEntry, shard);
+	shard->count++;
+}
+
+// hex file name back to the key it was made from, -1 if it isn't one
+static int hexToDigest(const char *hex, uint8_t *digest) {
+	int i;
+
+	if (strlen(hex) != HEX_BYTES || strspn(hex, "0123456789abcdef") != HEX_BYTES)
+		return -1;
+	for (i = 0; i < DIGEST_BYTES; i++)
+		sscanf(hex + 2 * i, "%2hhx", &digest[i]);
+	return 0;
+}
+
+// removes downloads cut short by the last exit and objects the index no longer knows about
+static void removeStrays(struct cacheShard *shard) {
+	char fileName[PATH_MAX];
+	uint8_t key[DIGEST_BYTES];
+	struct dirent *dirEntry;
+	size_t nameLength;
+	DIR *dir;
+
+	if ((dir = opendir(shard->directory)) == NULL)
+		return;
+
+	while ((dirEntry = readdir(dir)) != NULL) {
+		nameLength = strlen(dirEntry->d_name);
+		if ((nameLength > 5 && strcmp(dirEntry->d_name + nameLength - 5, ".part") == 0) ||
+				(hexToDigest(dirEntry->d_name, key) == 0 && findSlot(key, shard) < 0)) {
+			if (shardPath(fileName, shard, dirEntry->d_name, "") == 0)
+				remove(fileName);
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * Rebuilds the index of a persistent directory from its shards' logs, so whatever was cached before a restart and
+ * hasn't expired is served without being fetched again. Objects come back on disk only, the in-memory tier starts out
+ * empty. Runs before the reaper starts, so nothing else touches the cache yet.
+ */
+static void warmStart(struct cache *cache) {
+	struct cacheShard *shard;
+	journalHeader header;
+	long replayed = 0, records;
+	int i, keyed = 0, restored = 0;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		if (readJournalHeader(shard->journalFile, &header) < 0)
+			continue;
+
+		// keep hashing keys the way the directory's logs did, or they'd all miss
+		if (!keyed) {
+			setKeyHash(header.keyHash, header.seed);
+			keyed = 1;
+		}
+		if (header.keyHash == (uint32_t)keyHashAlgorithm() && header.seed == keyHashSeed() &&
+				(records = replayJournal(shard->journalFile, restoreRecord, shard)) > 0)
+			replayed += records;
+	}
+	if (!keyed)
+		setKeyHash(KEY_HASH, randomKeySeed());
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		removeStrays(&cache->shards[i]);
+		compactJournal(&cache->shards[i]);
+		restored += cache->shards[i].count;
+	}
+	if (replayed > 0)
+		fprintf(stderr, "Warm started %d cached objects from %ld index records, keyed by %s\n", restored, replayed,
+				keyHashName(keyHashAlgorithm()));
+}
+
+// removes path and, if it's a directory, everything in it
+static void removeTree(const char *path) {
+	char child[PATH_MAX];
+	struct dirent *dirEntry;
+	struct stat pathStat;
+	DIR *dir;
+	int length;
+
+	if (lstat(path, &pathStat) == 0 && S_ISDIR(pathStat.st_mode) && (dir = opendir(path)) != NULL) {
+		while ((dirEntry = readdir(dir)) != NULL) {
+			if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+				continue;
+			length = snprintf(child, PATH_MAX, "%s/%s", path, dirEntry->d_name);
+			if (length > 0 && length < PATH_MAX)
+				removeTree(child);
+		}
+		closedir(dir);
+	}
+	remove(path);
+}
+
 // also acts as a destructor for the cache
 void clearCache(struct cache *cache) {
-	// no need to use mutex lock since this should only be called during termination of the main
-	int i;
-	struct destructionArgs *dArgs;
-	for (i = 0; i < cache->count; i++) {
-		dArgs = malloc(sizeof(struct destructionArgs));
-		dArgs->c = cache;
-		dArgs->cEntry = cache->array[i];
-		dArgs->doDetach = 0;
-		deleteCacheEntry((void *)dArgs);
-	}
-
-	// TODO: Delete cache directory
-	pthread_mutex_destroy(cache->mutex);
-	pthread_mutex_destroy(cache->hostnameMutex);
-	free(cache->array);
-	free(cache->mutex);
-	free(cache->hostnameMutex);
+	// no need to use the locks since this should only be called during termination of the main
+	pthread_mutex_lock(&cache->reaperMutex);
+	cache->stopReaper = 1;
+	pthread_cond_signal(&cache->reaperCond);
+	pthread_mutex_unlock(&cache->reaperMutex);
+	pthread_join(cache->reaper, NULL);
+
+	freeShards(cache, CACHE_SHARDS);
+
+	// a temporary directory goes with the proxy, along with the DNS snapshot and any .part files left in it. One given
+	// on the command line is kept for the next start to warm up from.
+	if (!cache->persistent)
+		removeTree(cache->cacheDirectory);
+	pthread_mutex_destroy(&cache->reaperMutex);
+	pthread_cond_destroy(&cache->reaperCond);
+	slabDestroy(&cache->memory);  // takes every in-memory object with it
 	free(cache->cacheDirectory);
 	free(cache->dnsFile);
 	free(cache);
 }
 
 void freeCacheEntry(cacheEntry *cEntry) {
-	free(cEntry->requestHash);
 	free(cEntry);
 }
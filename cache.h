@@ -8,36 +8,155 @@
 #include <time.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/limits.h>
+#include "macro.h"
+#include "slab.h"
 
+// a small object's whole response, held in a slab chunk so hits on it never touch the filesystem
 typedef struct {
+	int refs;  // the index holds one, every reply sending from it holds another
+	int sizeClass;
+	size_t length;
+	struct slabAllocator *allocator;
+	char data[];
+} memoryObject;
+
+// what revalidating a cached object takes, from the response that filled it. Empty strings when not given.
+typedef struct {
+	char etag[VALIDATOR_BYTES];
+	char lastModified[VALIDATOR_BYTES];
+} cacheValidators;
+
+typedef struct cacheEntry {
+	uint8_t key[DIGEST_BYTES];  // hash of method, host, port and path, what the index is keyed on
+	char requestHash[HEX_BYTES + 1];  // hex form of key, used as the file name
 	time_t t;
-	char *requestHash;
+	time_t expires;  // served without asking the destination until then
+	time_t staleUntil;  // still served after expires while a single refresh runs, until then
+	long staleGrace;  // the grace window the response asked for, -1 for the cache's
+	time_t removeAt;  // when the reaper drops it, later than staleUntil if it has validators to be revalidated with
+	off_t size;
+	cacheValidators validators;
+	struct cacheEntry *wheelNext;  // neighbours in the expiry wheel bucket
+	struct cacheEntry *wheelPrev;
+	memoryObject *memory;  // NULL unless the object is also in the in-memory tier
+	int referenced;  // CLOCK bit, set by hits and cleared as the hand passes
+	struct cacheEntry *clockNext;  // neighbours in the CLOCK ring of memory's size class
+	struct cacheEntry *clockPrev;
+	int framed;  // the response says where it ends, so the client connection can carry another request after it
 } cacheEntry;
 
-struct cache {
-	cacheEntry **array;
-	pthread_mutex_t *mutex;
-	pthread_mutex_t *hostnameMutex;
-	char *cacheDirectory;
-	char *dnsFile;
+// what cacheLookup() found, either memory or fd is set
+typedef struct {
+	int fd;
+	memoryObject *memory;
+	int framed;
+	int stale;  // past its expiry but inside the grace window, it wants refreshing
+} cacheHit;
+
+// one thread waiting on somebody else's fetch of the same object
+typedef struct fetchWaiter {
+	int notifyfd;  // eventfd of the worker the waiting connection lives on
+	int waiting;  // caught up with the fetch and wants to hear about more data
+	struct fetchWaiter *next;
+} fetchWaiter;
+
+/**
+ * A miss that is being fetched right now. The first requester downloads it into a .part file, everyone else who
+ * misses on the same key while it's running reads the same file as it grows. Guarded by shard->inflightMutex.
+ */
+typedef struct inflightFetch {
+	uint8_t key[DIGEST_BYTES];
+	char requestHash[HEX_BYTES + 1];
+	char partialName[PATH_MAX];
+	int fd;
+	off_t available;  // bytes of the file written so far
+	int state;
+	int framed;  // set by the leader before it finishes, see cacheEntry
+	cacheValidators validators;  // likewise
+	long maxAge;  // likewise, seconds the object stays fresh or -1 for the cache's timeout
+	long staleGrace;  // likewise, seconds it's served stale after that or -1 for the cache's grace window
+	int storable;  // likewise, 0 if the response mustn't be kept once it's been passed on
+	int staleFd;  // the expired copy asked about with a conditional request, -1 unless revalidating
+	int staleFramed;
+	long staleLifetime;  // seconds it was fresh for, kept unless the 304 says otherwise
+	long staleWindow;  // the grace window it was given, likewise
+	cacheValidators staleValidators;
+	int refs;
+	fetchWaiter *waiters;
+	struct cacheShard *shard;
+	struct inflightFetch *next;
+} inflightFetch;
+
+/**
+ * One partition of the cache. Keys are spread over the shards by hash, each has its own lock, index, expiry wheel,
+ * in-flight table, CLOCK rings and subdirectory, so requests for different objects rarely wait on each other.
+ */
+struct cacheShard {
+	cacheEntry **slots;  // open addressing table with linear probing, capacity is a power of two
+	pthread_rwlock_t lock;  // lookups share it, inserts and removals take it exclusively
+	char directory[PATH_MAX];  // where this shard's files and index log are
 	int count;
 	int capacity;
-	int timeout;
+
+	// timing wheel of one second buckets, an entry sits in bucket (removeAt % WHEEL_SLOTS). Guarded by lock.
+	cacheEntry **wheel;
+	time_t wheelTime;  // last second the reaper has swept
+
+	inflightFetch *inflight[INFLIGHT_SLOTS];  // chained by key
+	pthread_mutex_t inflightMutex;
+
+	// in-memory objects, one CLOCK ring per slab size class. Guarded by lock.
+	cacheEntry *clockHands[SLAB_CLASSES];
+	int clockCounts[SLAB_CLASSES];
+
+	int journalfd;  // append-only index log of a persistent directory, -1 otherwise. Written under lock.
+	char journalFile[PATH_MAX];
+	long journalRecords;  // records in the log, rewritten once they're far more than the entries
+
+	struct cache *cache;
 };
 
-struct destructionArgs {
-	struct cache *c;
-	cacheEntry *cEntry;
-	int doDetach;
+struct cache {
+	struct cacheShard shards[CACHE_SHARDS];
+	char *cacheDirectory;
+	char *dnsFile;  // where the DNS cache is snapshotted
+	int persistent;  // cacheDirectory was given and outlives the proxy, files are kept on exit
+	int timeout;
+	int staleGrace;  // seconds an expired object is still served while it's refreshed, unless the response says
+
+	// one thread expires every shard's entries, so the thread count doesn't grow with the cache
+	pthread_t reaper;
+	pthread_mutex_t reaperMutex;
+	pthread_cond_t reaperCond;
+	int stopReaper;
+
+	struct slabAllocator memory;  // shared by every shard's in-memory tier, it has its own lock
 };
 
-struct cache *initCache(int timeout);
+struct cache *initCache(int timeout, int staleGrace, size_t memoryBudget, const char *directory);
+
+void addToCache(const uint8_t *key, const char *requestHash, const char *partialName, int fd, off_t size, int framed,
+		const cacheValidators *validators, long maxAge, long staleGrace, struct cache *cache);
+
+int cacheLookup(const uint8_t *key, struct cache *cache, int lockEnabled, int wantMemory, cacheHit *hit);
+
+void releaseMemoryObject(memoryObject *memory);
+
+int joinFetch(const uint8_t *key, const char *requestHash, struct cache *cache, fetchWaiter *waiter,
+		inflightFetch **fetch, cacheHit *hit);
+
+int refreshFetch(const uint8_t *key, const char *requestHash, struct cache *cache, inflightFetch **fetch, int *fd);
+
+void publishFetch(inflightFetch *fetch, off_t available);
 
-void addToCache(char *requestHash, struct cache *cache);
+int followFetch(inflightFetch *fetch, fetchWaiter *waiter, off_t sent, off_t *available);
 
-FILE *cacheLookup(char *requestHash, struct cache *cache, int lockEnabled);
+void finishFetch(inflightFetch *fetch, int state);
 
-void * deleteCacheEntry(void *dArgs);
+void leaveFetch(inflightFetch *fetch, fetchWaiter *waiter);
 
 void clearCache(struct cache *cache);
 
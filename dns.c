@@ -0,0 +1,342 @@
+//
+// Created by jmalcy on 11/29/20.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "dns.h"
+
+static void *resolveQueued(void *vDns);
+
+struct dnsCache *initDnsCache(int ttl, int negativeTtl) {
+	struct dnsCache *dns;
+
+	if ((dns = calloc(1, sizeof(struct dnsCache))) == NULL) {
+		perror("Failed to allocate DNS cache");
+		return NULL;
+	}
+	dns->ttl = ttl;
+	dns->negativeTtl = negativeTtl;
+	pthread_rwlock_init(&dns->lock, NULL);
+	pthread_mutex_init(&dns->jobMutex, NULL);
+	pthread_cond_init(&dns->jobCond, NULL);
+
+	for (dns->resolverCount = 0; dns->resolverCount < DNS_RESOLVERS; dns->resolverCount++) {
+		if (pthread_create(&dns->resolvers[dns->resolverCount], NULL, resolveQueued, dns) != 0) {
+			perror("Failed to start resolver thread");
+			clearDnsCache(dns);
+			return NULL;
+		}
+	}
+
+	return dns;
+}
+
+// djb2 of the lowercased name, host names don't care about case
+static dnsEntry **dnsBucket(struct dnsCache *dns, const char *host) {
+	unsigned long h = 5381;
+
+	while (*host)
+		h = h * 33 + (unsigned char)tolower(*host++);
+	return &dns->buckets[h % DNS_SLOTS];
+}
+
+// caller holds dns->lock
+static dnsEntry *findEntry(struct dnsCache *dns, const char *host) {
+	dnsEntry *entry;
+
+	for (entry = *dnsBucket(dns, host); entry != NULL; entry = entry->next) {
+		if (strcasecmp(entry->host, host) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Records what host resolved to, replacing what was there before. Expired neighbours in the bucket are dropped on the
+ * way, so hosts nobody asks for anymore don't pile up.
+ */
+static void storeEntry(struct dnsCache *dns, const char *host, const struct in_addr *addrs, int addrCount,
+		time_t expires) {
+	dnsEntry **link, *entry, *found = NULL;
+	time_t now = time(NULL);
+
+	if (strlen(host) >= MAXHOST)
+		return;
+
+	pthread_rwlock_wrlock(&dns->lock);
+	link = dnsBucket(dns, host);
+	while ((entry = *link) != NULL) {
+		if (strcasecmp(entry->host, host) == 0) {
+			found = entry;
+		} else if (entry->expires <= now) {
+			*link = entry->next;
+			dns->count--;
+			free(entry);
+			continue;
+		}
+		link = &entry->next;
+	}
+
+	if (found == NULL) {
+		if ((found = calloc(1, sizeof(dnsEntry))) == NULL) {
+			perror("Failed to allocate DNS entry");
+			pthread_rwlock_unlock(&dns->lock);
+			return;
+		}
+		strcpy(found->host, host);
+		link = dnsBucket(dns, host);
+		found->next = *link;
+		*link = found;
+		dns->count++;
+	}
+	memcpy(found->addrs, addrs, sizeof(struct in_addr) * addrCount);
+	found->addrCount = addrCount;
+	found->expires = expires;
+	pthread_rwlock_unlock(&dns->lock);
+}
+
+// what the cache knows about host: DNS_FOUND with addr set, DNS_FAILED, or DNS_PENDING if it has to be resolved
+static int probeEntry(struct dnsCache *dns, const char *host, struct in_addr *addr) {
+	dnsEntry *entry;
+	int status = DNS_PENDING;
+	unsigned int turn;
+
+	pthread_rwlock_rdlock(&dns->lock);
+	if ((entry = findEntry(dns, host)) != NULL && entry->expires > time(NULL)) {
+		status = DNS_FAILED;
+		if (entry->addrCount > 0) {
+			turn = __atomic_fetch_add(&entry->rotation, 1, __ATOMIC_RELAXED);
+			*addr = entry->addrs[turn % entry->addrCount];
+			status = DNS_FOUND;
+		}
+	}
+	pthread_rwlock_unlock(&dns->lock);
+
+	return status;
+}
+
+static dnsJob *findJob(dnsJob *job, const char *host) {
+	while (job != NULL && strcasecmp(job->host, host) != 0)
+		job = job->next;
+	return job;
+}
+
+/**
+ * Finds an IPv4 address for host without blocking. Hosts with several addresses hand them out in turn. If the cache has
+ * nothing fresh about host, the waiter is queued on a lookup, shared with anyone else asking for the same host, and its
+ * notifyfd is written once the answer is in. Calling again then gives the answer.
+ * @return DNS_FOUND with addr set, DNS_FAILED, or DNS_PENDING.
+ */
+int dnsResolve(struct dnsCache *dns, const char *host, dnsWaiter *waiter, struct in_addr *addr) {
+	dnsJob *job, **link;
+	int status;
+
+	if (host == NULL || strlen(host) >= MAXHOST)
+		return DNS_FAILED;
+	if (waiter->job != NULL)  // woken for something else
+		return DNS_PENDING;
+	if ((status = probeEntry(dns, host, addr)) != DNS_PENDING)
+		return status;
+
+	pthread_mutex_lock(&dns->jobMutex);
+	if ((job = findJob(dns->queued, host)) == NULL && (job = findJob(dns->running, host)) == NULL) {
+		// a lookup may have finished since the probe, they're only dropped once their answer is stored
+		if ((status = probeEntry(dns, host, addr)) != DNS_PENDING) {
+			pthread_mutex_unlock(&dns->jobMutex);
+			return status;
+		}
+
+		if ((job = calloc(1, sizeof(dnsJob))) == NULL) {
+			perror("Failed to allocate DNS lookup");
+			pthread_mutex_unlock(&dns->jobMutex);
+			return DNS_FAILED;
+		}
+		strcpy(job->host, host);
+		for (link = &dns->queued; *link != NULL; link = &(*link)->next);
+		*link = job;
+		pthread_cond_signal(&dns->jobCond);
+	}
+
+	waiter->job = job;
+	waiter->next = job->waiters;
+	job->waiters = waiter;
+	pthread_mutex_unlock(&dns->jobMutex);
+
+	return DNS_PENDING;
+}
+
+// the waiting connection is going away, it mustn't be woken anymore
+void dnsCancel(struct dnsCache *dns, dnsWaiter *waiter) {
+	dnsWaiter **link;
+
+	pthread_mutex_lock(&dns->jobMutex);
+	if (waiter->job != NULL) {
+		for (link = &waiter->job->waiters; *link != NULL; link = &(*link)->next) {
+			if (*link == waiter) {
+				*link = waiter->next;
+				break;
+			}
+		}
+		waiter->job = NULL;
+	}
+	pthread_mutex_unlock(&dns->jobMutex);
+}
+
+// resolver thread: takes queued lookups one at a time, stores the answer and wakes whoever was waiting for it
+static void *resolveQueued(void *vDns) {
+	struct dnsCache *dns = (struct dnsCache *)vDns;
+	struct addrinfo hints, *infoResults, *info;
+	struct in_addr addrs[DNS_MAX_ADDRS];
+	dnsJob *job, **link;
+	dnsWaiter *waiter;
+	uint64_t one = 1;
+	int addrCount, lastfd;
+
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pthread_mutex_lock(&dns->jobMutex);
+	while (!dns->stopResolvers) {
+		if ((job = dns->queued) == NULL) {
+			pthread_cond_wait(&dns->jobCond, &dns->jobMutex);
+			continue;
+		}
+		dns->queued = job->next;
+		job->next = dns->running;
+		dns->running = job;
+		pthread_mutex_unlock(&dns->jobMutex);
+
+		addrCount = 0;
+		infoResults = NULL;
+		if (getaddrinfo(job->host, NULL, &hints, &infoResults) == 0) {
+			for (info = infoResults; info != NULL && addrCount < DNS_MAX_ADDRS; info = info->ai_next)
+				addrs[addrCount++] = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
+			freeaddrinfo(infoResults);
+		}
+		storeEntry(dns, job->host, addrs, addrCount, time(NULL) + (addrCount > 0 ? dns->ttl : dns->negativeTtl));
+
+		pthread_mutex_lock(&dns->jobMutex);
+		for (link = &dns->running; *link != job; link = &(*link)->next);
+		*link = job->next;
+
+		// waiters on the same worker tend to be next to each other, one wakeup covers all of them
+		lastfd = -1;
+		for (waiter = job->waiters; waiter != NULL; waiter = waiter->next) {
+			waiter->job = NULL;
+			if (waiter->notifyfd != lastfd && write(waiter->notifyfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+				perror("Failed to wake DNS waiter");
+			lastfd = waiter->notifyfd;
+		}
+		free(job);
+	}
+	pthread_mutex_unlock(&dns->jobMutex);
+
+	return NULL;
+}
+
+/**
+ * Reads a snapshot written by saveDnsCache(), one host per line as "host,expires,address[,address...]" or
+ * "host,expires,UNKNOWN". Entries that have expired since are skipped.
+ * @return Number of hosts loaded, or -1 if the file couldn't be opened.
+ */
+int loadDnsCache(struct dnsCache *dns, const char *fileName) {
+	char lineBuf[MAXLINE], *savePoint = NULL, *host, *expiresStr, *addrStr;
+	struct in_addr addrs[DNS_MAX_ADDRS];
+	time_t expires, now = time(NULL);
+	int addrCount, loaded = 0;
+	FILE *dnsFile;
+
+	if ((dnsFile = fopen(fileName, "r")) == NULL)
+		return -1;
+
+	while (fgets(lineBuf, MAXLINE, dnsFile)) {
+		if ((host = strtok_r(lineBuf, ",", &savePoint)) == NULL ||
+				(expiresStr = strtok_r(NULL, ",", &savePoint)) == NULL)
+			continue;
+		if ((expires = atol(expiresStr)) <= now)
+			continue;
+
+		addrCount = 0;
+		while (addrCount < DNS_MAX_ADDRS && (addrStr = strtok_r(NULL, ",\n", &savePoint)) != NULL) {
+			if (inet_pton(AF_INET, addrStr, &addrs[addrCount]) == 1)
+				addrCount++;
+		}
+		storeEntry(dns, host, addrs, addrCount, expires);
+		loaded++;
+	}
+
+	fclose(dnsFile);
+	return loaded;
+}
+
+// writes every unexpired host out for loadDnsCache(), returns -1 if the file couldn't be written
+int saveDnsCache(struct dnsCache *dns, const char *fileName) {
+	char ip[INET_ADDRSTRLEN];
+	time_t now = time(NULL);
+	dnsEntry *entry;
+	FILE *dnsFile;
+	int i, j;
+
+	if ((dnsFile = fopen(fileName, "w")) == NULL) {
+		perror("Failed to open DNS cache file for writing");
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&dns->lock);
+	for (i = 0; i < DNS_SLOTS; i++) {
+		for (entry = dns->buckets[i]; entry != NULL; entry = entry->next) {
+			if (entry->expires <= now)
+				continue;
+
+			fprintf(dnsFile, "%s,%ld", entry->host, (long)entry->expires);
+			for (j = 0; j < entry->addrCount; j++)
+				fprintf(dnsFile, ",%s", inet_ntop(AF_INET, &entry->addrs[j], ip, INET_ADDRSTRLEN));
+			fprintf(dnsFile, entry->addrCount > 0 ? "\n" : ",UNKNOWN\n");
+		}
+	}
+	pthread_rwlock_unlock(&dns->lock);
+
+	fclose(dnsFile);
+	return 0;
+}
+
+void clearDnsCache(struct dnsCache *dns) {
+	int i;
+	dnsEntry *entry, *next;
+	dnsJob *job;
+
+	// a resolver in the middle of a lookup finishes it first
+	pthread_mutex_lock(&dns->jobMutex);
+	dns->stopResolvers = 1;
+	pthread_cond_broadcast(&dns->jobCond);
+	pthread_mutex_unlock(&dns->jobMutex);
+	for (i = 0; i < dns->resolverCount; i++)
+		pthread_join(dns->resolvers[i], NULL);
+
+	while ((job = dns->queued) != NULL) {
+		dns->queued = job->next;
+		free(job);
+	}
+
+	for (i = 0; i < DNS_SLOTS; i++) {
+		for (entry = dns->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+	}
+	pthread_rwlock_destroy(&dns->lock);
+	pthread_mutex_destroy(&dns->jobMutex);
+	pthread_cond_destroy(&dns->jobCond);
+	free(dns);
+}
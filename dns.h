@@ -0,0 +1,72 @@
+//
+// Created by jmalcy on 11/29/20.
+//
+
+#ifndef HTTPPROXY_DNS_H
+#define HTTPPROXY_DNS_H
+
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "macro.h"
+
+// a host and what it resolved to, addrCount is 0 when the lookup failed
+typedef struct dnsEntry {
+	char host[MAXHOST];
+	struct in_addr addrs[DNS_MAX_ADDRS];
+	int addrCount;
+	unsigned int rotation;  // spreads connections over the addresses
+	time_t expires;
+	struct dnsEntry *next;
+} dnsEntry;
+
+struct dnsJob;
+
+// a connection waiting for a host to be resolved
+typedef struct dnsWaiter {
+	int notifyfd;  // eventfd of the worker the waiting connection lives on
+	struct dnsJob *job;  // the lookup it's waiting on, NULL when not waiting
+	struct dnsWaiter *next;
+} dnsWaiter;
+
+// a host being resolved for one or more waiters, only ever one per host at a time
+typedef struct dnsJob {
+	char host[MAXHOST];
+	dnsWaiter *waiters;
+	struct dnsJob *next;  // next in the queue, or among the running jobs once taken
+} dnsJob;
+
+/**
+ * Resolved hosts chained by name. Lookups share the lock, so a hit costs a hash and a short chain walk. Failures are
+ * kept too, for less time, so a bad host doesn't hit the resolver on every request.
+ */
+struct dnsCache {
+	dnsEntry *buckets[DNS_SLOTS];
+	int count;
+	int ttl;
+	int negativeTtl;
+	pthread_rwlock_t lock;
+
+	// getaddrinfo() blocks, so misses are queued for a few resolver threads. Guarded by jobMutex.
+	dnsJob *queued;
+	dnsJob *running;
+	pthread_t resolvers[DNS_RESOLVERS];
+	int resolverCount;
+	int stopResolvers;
+	pthread_mutex_t jobMutex;
+	pthread_cond_t jobCond;
+};
+
+struct dnsCache *initDnsCache(int ttl, int negativeTtl);
+
+int dnsResolve(struct dnsCache *dns, const char *host, dnsWaiter *waiter, struct in_addr *addr);
+
+void dnsCancel(struct dnsCache *dns, dnsWaiter *waiter);
+
+int loadDnsCache(struct dnsCache *dns, const char *fileName);
+
+int saveDnsCache(struct dnsCache *dns, const char *fileName);
+
+void clearDnsCache(struct dnsCache *dns);
+
+#endif //HTTPPROXY_DNS_H
@@ -0,0 +1,285 @@
+//
+// Created by jmalcy on 12/02/20.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include "framing.h"
+
+void initFramer(responseFramer *framer) {
+	bzero(framer, sizeof(responseFramer));
+	framer->contentLength = -1;
+	framer->maxAge = -1;
+	framer->staleGrace = -1;
+}
+
+// a Cache-Control delta-seconds value, anything negative counts as already stale
+static long deltaSeconds(const char *value) {
+	long seconds = strtol(value, NULL, 10);
+	return seconds < 0 ? 0 : seconds;
+}
+
+// what Cache-Control asks of a shared cache. s-maxage is meant for one and wins over max-age.
+static void parseCacheControl(responseFramer *framer, const char *value) {
+	const char *directive;
+
+	if (strcasestr(value, "no-store") != NULL || strcasestr(value, "private") != NULL)
+		framer->noStore = 1;
+	if (strcasestr(value, "no-cache") != NULL)
+		framer->maxAge = 0;  // may be kept, but is asked about every time
+	else if ((directive = strcasestr(value, "s-maxage=")) != NULL)
+		framer->maxAge = deltaSeconds(directive + 9);
+	else if ((directive = strcasestr(value, "max-age=")) != NULL)
+		framer->maxAge = deltaSeconds(directive + 8);
+
+	// an expired copy of these must never be handed out without asking first
+	if (strcasestr(value, "no-cache") != NULL || strcasestr(value, "must-revalidate") != NULL ||
+			strcasestr(value, "proxy-revalidate") != NULL)
+		framer->staleGrace = 0;
+	else if ((directive = strcasestr(value, "stale-while-revalidate=")) != NULL)
+		framer->staleGrace = deltaSeconds(directive + 23);
+}
+
+/**
+ * Works out how the body is framed from the complete head. Every line is looked at through a copy, bounded by the
+ * head's length, so the head is left as it came and a stray NUL in it can't run a scan off its end.
+ */
+static int parseHead(responseFramer *framer) {
+	const char *head = framer->head, *headEnd = framer->head + framer->headLength, *line, *eol;
+	char text[MAXLINE], *value, *end;
+	size_t length;
+	int chunked = 0;
+
+	if (framer->headLength < 12 || strncmp(head, "HTTP/1.", 7) != 0 || memchr(head, '\0', framer->headLength) != NULL)
+		return -1;
+	framer->persistent = head[7] == '1';  // HTTP/1.1 keeps the connection unless told otherwise
+	framer->status = atoi(head + 9);
+
+	for (line = memchr(head, '\n', framer->headLength) + 1; line < headEnd && *line != '\r' && *line != '\n';
+			line = eol + 1) {
+		if ((eol = memchr(line, '\n', headEnd - line)) == NULL)
+			return -1;
+		length = eol - line;
+		if (length > 0 && line[length - 1] == '\r')
+			length--;
+		if (length >= sizeof(text))
+			length = sizeof(text) - 1;  // only ever cuts into a value too long to keep anyway
+		memcpy(text, line, length);
+		text[length] = '\0';
+
+		if ((value = strchr(text, ':')) == NULL)
+			continue;
+		for (value++; *value == ' ' || *value == '\t'; value++);
+
+		if (strncasecmp(text, "Content-Length:", 15) == 0) {
+			framer->contentLength = strtol(value, &end, 10);
+			if (end == value || framer->contentLength < 0)
+				return -1;
+		} else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0) {
+			chunked = strcasestr(value, "chunked") != NULL;
+		} else if (strncasecmp(text, "Cache-Control:", 14) == 0) {
+			parseCacheControl(framer, value);
+		} else if (strncasecmp(text, "ETag:", 5) == 0) {
+			snprintf(framer->etag, VALIDATOR_BYTES, "%s", value);
+		} else if (strncasecmp(text, "Last-Modified:", 14) == 0) {
+			snprintf(framer->lastModified, VALIDATOR_BYTES, "%s", value);
+		} else if (strncasecmp(text, "Connection:", 11) == 0) {
+			if (strcasestr(value, "close") != NULL)
+				framer->persistent = 0;
+			else if (strcasestr(value, "keep-alive") != NULL)
+				framer->persistent = 1;
+		}
+	}
+
+	// chunked wins over Content-Length, and a few statuses never have a body whatever the headers say
+	if (framer->status == 204 || framer->status == 304 || (framer->status >= 100 && framer->status < 200)) {
+		framer->framing = FRAME_NONE;
+	} else if (chunked) {
+		framer->framing = FRAME_CHUNKED;
+		framer->chunkState = CHUNK_SIZE;
+	} else if (framer->contentLength >= 0) {
+		framer->framing = FRAME_LENGTH;
+		framer->remaining = framer->contentLength;
+	} else {
+		framer->framing = FRAME_CLOSE;
+		framer->persistent = 0;
+	}
+
+	framer->done = framer->framing == FRAME_NONE || (framer->framing == FRAME_LENGTH && framer->remaining == 0);
+	return 0;
+}
+
+// forgets an interim response's head, keeping the buffer it was read into
+static void resetHead(responseFramer *framer) {
+	char *head = framer->head;
+	size_t capacity = framer->headCapacity;
+
+	initFramer(framer);
+	framer->head = head;
+	framer->headCapacity = capacity;
+}
+
+/**
+ * Feeds bytes read from the destination to the framer while it's still in the head. Interim 1xx responses, like
+ * 100 Continue or 103 Early Hints, are dropped as they're found, what's collected in the end is the final head only.
+ * @param a Where the head is collected, the request's arena.
+ * @return How many of the bytes belong to the head or the interim responses before it, all of them unless the final
+ * head ended in this piece. -1 if a head is malformed or too long.
+ */
+ssize_t framerHead(responseFramer *framer, arena *a, const char *buf, size_t len) {
+	size_t scanFrom = framer->headLength >= 3 ? framer->headLength - 3 : 0, filled, headEnd, i;
+	size_t needed = framer->headLength + len + 1;
+	char *grown;
+
+	if (needed > framer->headCapacity) {
+		if ((grown = arenaGrow(a, framer->head, framer->headLength, needed)) == NULL)
+			return -1;
+		framer->head = grown;
+		framer->headCapacity = needed;
+	}
+	memcpy(framer->head + framer->headLength, buf, len);
+	filled = framer->headLength + len;
+
+	// the head ends with an empty line, \r\n or a bare \n
+	for (i = scanFrom; i < filled; i++) {
+		if (framer->head[i] != '\n')
+			continue;
+		if (i + 1 < filled && framer->head[i + 1] == '\n')
+			headEnd = i + 2;
+		else if (i + 2 < filled && framer->head[i + 1] == '\r' && framer->head[i + 2] == '\n')
+			headEnd = i + 3;
+		else
+			continue;
+
+		framer->headLength = headEnd;
+		if (parseHead(framer) < 0 || framer->status == 101)  // nothing asked to switch protocols
+			return -1;
+		if (framer->status >= 200 || framer->status < 100) {
+			framer->headDone = 1;
+			return len - (filled - headEnd);
+		}
+
+		// an interim response, the real one follows on the connection and may already be here
+		filled -= headEnd;
+		memmove(framer->head, framer->head + headEnd, filled);
+		resetHead(framer);
+		i = (size_t)-1;
+	}
+
+	framer->headLength = filled;
+	if (framer->headLength > MAX_HEAD_BYTES)
+		return -1;
+	return len;
+}
+
+/**
+ * Feeds body bytes the caller had to read to the framer. Only chunked bodies are looked at, the rest are counted.
+ * @return How many of the bytes belong to this response, or -1 if the chunked framing is malformed.
+ */
+ssize_t framerBody(responseFramer *framer, const char *buf, size_t len) {
+	size_t i = 0, n;
+	int digit;
+
+	if (framer->framing == FRAME_CLOSE)
+		return len;
+	if (framer->framing != FRAME_CHUNKED) {
+		n = len < (size_t)framer->remaining ? len : (size_t)framer->remaining;
+		framerMoved(framer, n);
+		return n;
+	}
+
+	while (i < len && !framer->done) {
+		char c = buf[i];
+
+		switch (framer->chunkState) {
+			case CHUNK_SIZE:  // lineLength: 0 before any digit, 1 in the digits, 2 in an extension
+				if (c == '\n') {
+					if (framer->lineLength == 0)
+						return -1;
+					framer->chunkState = framer->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+					framer->lineLength = 0;
+				} else if (framer->lineLength < 2 && isxdigit(c)) {
+					digit = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+					if (framer->remaining > (LONG_MAX - digit) / 16)
+						return -1;
+					framer->remaining = framer->remaining * 16 + digit;
+					framer->lineLength = 1;
+				} else if (framer->lineLength > 0 && (c == ';' || c == ' ' || c == '\t')) {
+					framer->lineLength = 2;
+				} else if (c != '\r' && framer->lineLength < 2) {
+					return -1;
+				}
+				i++;
+				break;
+			case CHUNK_DATA:
+				n = len - i < (size_t)framer->remaining ? len - i : (size_t)framer->remaining;
+				framerMoved(framer, n);
+				i += n;
+				break;
+			case CHUNK_DATA_END:
+				if (c == '\n')
+					framer->chunkState = CHUNK_SIZE;
+				else if (c != '\r')
+					return -1;
+				i++;
+				break;
+			case CHUNK_TRAILER:
+				if (c == '\n' && framer->lineLength == 0)
+					framer->done = 1;
+				else if (c == '\n')
+					framer->lineLength = 0;
+				else if (c != '\r')
+					framer->lineLength++;
+				i++;
+				break;
+		}
+	}
+	return i;
+}
+
+// how many body bytes can be moved without the framer seeing them, so they can be spliced
+size_t framerSpliceable(const responseFramer *framer) {
+	if (!framer->headDone || framer->done)
+		return 0;
+	if (framer->framing == FRAME_CLOSE)
+		return MAXBUF * 8;
+	if (framer->framing == FRAME_LENGTH || (framer->framing == FRAME_CHUNKED && framer->chunkState == CHUNK_DATA))
+		return framer->remaining;
+	return 0;
+}
+
+// moved body bytes went past without being looked at
+void framerMoved(responseFramer *framer, size_t moved) {
+	if (framer->framing != FRAME_LENGTH && framer->framing != FRAME_CHUNKED)
+		return;
+
+	framer->remaining -= moved;
+	if (framer->remaining > 0)
+		return;
+	if (framer->framing == FRAME_LENGTH)
+		framer->done = 1;
+	else
+		framer->chunkState = CHUNK_DATA_END;
+}
+
+/**
+ * The destination closed the connection.
+ * @return 0 if that's how the response was meant to end, -1 if it was cut short.
+ */
+int framerClosed(responseFramer *framer) {
+	if (framer->done || (framer->headDone && framer->framing == FRAME_CLOSE)) {
+		framer->done = 1;
+		return 0;
+	}
+	return -1;
+}
+
+// the head goes when the arena it came from is rewound
+void freeFramer(responseFramer *framer) {
+	initFramer(framer);
+}
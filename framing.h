@@ -0,0 +1,58 @@
+//
+// Created by jmalcy on 12/02/20.
+//
+
+#ifndef HTTPPROXY_FRAMING_H
+#define HTTPPROXY_FRAMING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "macro.h"
+#include "arena.h"
+
+// where a chunked body is
+#define CHUNK_SIZE          0  // reading a chunk's hex size line
+#define CHUNK_DATA          1  // inside a chunk, remaining bytes of it to go
+#define CHUNK_DATA_END      2  // the \r\n after a chunk's data
+#define CHUNK_TRAILER       3  // trailer lines after the last chunk, up to an empty one
+
+/**
+ * Follows a response from the destination as it streams past, to know exactly where it ends. The head is collected
+ * and parsed, after that only the framing of the body is looked at: Content-Length, chunk sizes, or nothing when the
+ * response runs until the connection closes.
+ */
+typedef struct {
+	char *head;  // the status line and headers, once complete, from the request's arena
+	size_t headLength;
+	size_t headCapacity;
+	int headDone;
+	int status;
+	int framing;
+	int persistent;  // the destination keeps the connection open after this response
+	char etag[VALIDATOR_BYTES];  // validators to revalidate the cached copy with, empty unless given
+	char lastModified[VALIDATOR_BYTES];
+	long maxAge;  // seconds the response may be served from the cache without asking, -1 unless Cache-Control says
+	long staleGrace;  // seconds it may be served after that while it's refreshed, -1 unless Cache-Control says
+	int noStore;  // Cache-Control forbids a shared cache from keeping it
+	long contentLength;  // -1 unless given
+	long remaining;  // body left for FRAME_LENGTH, or of the current chunk
+	int chunkState;
+	int lineLength;  // of the trailer line being read
+	int done;
+} responseFramer;
+
+void initFramer(responseFramer *framer);
+
+ssize_t framerHead(responseFramer *framer, arena *a, const char *buf, size_t len);
+
+ssize_t framerBody(responseFramer *framer, const char *buf, size_t len);
+
+size_t framerSpliceable(const responseFramer *framer);
+
+void framerMoved(responseFramer *framer, size_t moved);
+
+int framerClosed(responseFramer *framer);
+
+void freeFramer(responseFramer *framer);
+
+#endif //HTTPPROXY_FRAMING_H
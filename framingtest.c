@@ -0,0 +1,133 @@
+//
+// Created by jmalcy on 12/13/20.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "framing.h"
+#include "arena.h"
+
+static int failures = 0;
+
+static void check(int condition, const char *what) {
+	if (!condition) {
+		fprintf(stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+// feeds a whole response to a fresh framer in one piece, returns what framerHead() did with it
+static ssize_t feed(responseFramer *framer, arena *a, const char *response, size_t length) {
+	initFramer(framer);
+	return framerHead(framer, a, response, length);
+}
+
+// a body fed to a framer in pieces, split wherever it has a '|'
+typedef struct {
+	const char *name;
+	const char *head;
+	const char *body;
+	int malformed;  // framerBody() gives up on it
+	ssize_t used;  // bytes that belong to the response, the rest is whatever follows it on the connection
+	int done;  // the end is seen without the destination closing
+	int closed;  // what framerClosed() says once the destination closes after the last piece
+} bodyCase;
+
+#define CHUNKED     "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+#define LENGTH10    "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n"
+#define CLOSE       "HTTP/1.0 200 OK\r\n\r\n"
+
+static const bodyCase bodyCases[] = {
+	{"chunk size split across reads", CHUNKED, "5|\r|\nhel|lo\r\n0\r|\n\r\n", 0, 15, 1, 0},
+	{"chunk extensions", CHUNKED, "5;name=\"v\" ;x\r\nhello\r\n0;last\r\n\r\n", 0, 32, 1, 0},
+	{"trailers", CHUNKED, "5\r\nhello\r\n0\r\nX-Sum: 1|2\r\nX-More: 3\r\n\r\n", 0, 37, 1, 0},
+	{"zero-length final chunk only", CHUNKED, "0\r\n\r\n", 0, 5, 1, 0},
+	{"bytes after the final chunk", CHUNKED, "1\r\na\r\n0\r\n\r\nHTTP/1.1", 0, 11, 1, 0},
+	{"chunk cut short", CHUNKED, "a\r\nhello", 0, 8, 0, -1},
+	{"oversized chunk size", CHUNKED, "ffffffffffffffffff\r\n", 1, 0, 0, -1},
+	{"invalid chunk size", CHUNKED, "zz\r\n", 1, 0, 0, -1},
+	{"empty chunk size line", CHUNKED, "\r\n", 1, 0, 0, -1},
+	{"data not followed by a line end", CHUNKED, "1\r\nab\r\n", 1, 0, 0, -1},
+	{"Content-Length split across reads", LENGTH10, "hel|lowor|ld", 0, 10, 1, 0},
+	{"bytes after a Content-Length body", LENGTH10, "hello|worldHTTP/1.1", 0, 10, 1, 0},
+	{"Content-Length body cut short", LENGTH10, "hello", 0, 5, 0, -1},
+	{"close-delimited", CLOSE, "hel|lo|world", 0, 10, 0, 0},
+};
+
+static void runBodyCase(const bodyCase *c, arena *a) {
+	responseFramer framer;
+	const char *piece = c->body, *bar;
+	ssize_t used = 0, n = 0;
+	size_t length;
+	char what[256];
+
+	if (feed(&framer, a, c->head, strlen(c->head)) != (ssize_t)strlen(c->head) || !framer.headDone) {
+		snprintf(what, sizeof(what), "%s: head", c->name);
+		check(0, what);
+		return;
+	}
+
+	while (*piece != '\0' && !framer.done && n >= 0) {
+		length = (bar = strchr(piece, '|')) != NULL ? (size_t)(bar - piece) : strlen(piece);
+		if ((n = framerBody(&framer, piece, length)) >= 0)
+			used += n;
+		piece += bar != NULL ? length + 1 : length;
+	}
+
+	snprintf(what, sizeof(what), "%s: malformed", c->name);
+	check((n < 0) == c->malformed, what);
+	if (c->malformed)
+		return;
+	snprintf(what, sizeof(what), "%s: bytes used", c->name);
+	check(used == c->used, what);
+	snprintf(what, sizeof(what), "%s: done", c->name);
+	check(framer.done == c->done, what);
+	snprintf(what, sizeof(what), "%s: destination closing", c->name);
+	check(framerClosed(&framer) == c->closed, what);
+}
+
+int main(void) {
+	static const char nulHead[] = "HTTP/1.1 200 OK\r\nX: a\0b\r\n\r\n";
+	static const char plain[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nETag: \"v1\"\r\n\r\nhello";
+	static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a.css>\r\n\r\n"
+			"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+	const char *final = strstr(interim, "HTTP/1.1 200");
+	responseFramer framer;
+	arena a = {0};
+	ssize_t used;
+	size_t i;
+
+	// a NUL anywhere in the head makes it malformed instead of cutting the scan short
+	check(feed(&framer, &a, nulHead, sizeof(nulHead) - 1) < 0, "head with a NUL is rejected");
+
+	used = feed(&framer, &a, plain, strlen(plain));
+	check(used == (ssize_t)strlen(plain) - 5, "head ends before the body");
+	check(framer.headDone && framer.status == 200, "status is read");
+	check(framer.framing == FRAME_LENGTH && framer.remaining == 5, "Content-Length frames the body");
+	check(strcmp(framer.etag, "\"v1\"") == 0, "ETag is kept");
+	check(memcmp(framer.head, plain, framer.headLength) == 0, "head is left as it arrived");
+
+	// interim responses are skipped, the head that's kept is the final one
+	used = feed(&framer, &a, interim, strlen(interim));
+	check(used == (ssize_t)strlen(interim) - 5, "interim heads are used up along with the final one");
+	check(framer.headDone && framer.status == 200, "final status is read");
+	check(framer.framing == FRAME_LENGTH && framer.remaining == 5, "final head frames the body");
+	check(framer.headLength == strlen(final) - 5 && memcmp(framer.head, final, framer.headLength) == 0,
+			"only the final head is kept");
+
+	// the same, a byte at a time
+	initFramer(&framer);
+	for (used = 0; !framer.headDone && used < (ssize_t)strlen(interim); used++)
+		check(framerHead(&framer, &a, interim + used, 1) >= 0, "interim heads split anywhere are fine");
+	check(used == (ssize_t)strlen(interim) - 5 && framer.status == 200, "split final head ends in the right place");
+
+	check(feed(&framer, &a, "HTTP/1.1 101 Switching Protocols\r\n\r\n", 36) < 0, "a protocol switch is refused");
+
+	for (i = 0; i < sizeof(bodyCases) / sizeof(bodyCases[0]); i++)
+		runBodyCase(&bodyCases[i], &a);
+
+	arenaFree(&a);
+	if (failures == 0)
+		printf("framing: all passed\n");
+	return failures > 0;
+}
@@ -0,0 +1,176 @@
+//
+// Created by jmalcy on 12/04/20.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/limits.h>
+#include "journal.h"
+#include "keyhash.h"
+
+// the whole buffer or nothing, short writes are retried
+static int writeAll(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t written;
+
+	while (len > 0) {
+		if ((written = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += written;
+		len -= written;
+	}
+	return 0;
+}
+
+// a header for the key hash in use now
+static void fillHeader(journalHeader *header) {
+	bzero(header, sizeof(journalHeader));
+	header->magic = JOURNAL_MAGIC;
+	header->keyHash = keyHashAlgorithm();
+	header->seed = keyHashSeed();
+}
+
+static void fillRecord(journalRecord *record, int type, const cacheEntry *cEntry) {
+	bzero(record, sizeof(journalRecord));
+	record->type = type;
+	memcpy(record->key, cEntry->key, DIGEST_BYTES);
+	if (type == JOURNAL_ADD) {
+		record->framed = cEntry->framed;
+		record->t = cEntry->t;
+		record->expires = cEntry->expires;
+		record->staleGrace = cEntry->staleGrace;
+		record->size = cEntry->size;
+		record->validators = cEntry->validators;
+	}
+}
+
+/**
+ * Reads how the keys in an existing log were hashed.
+ * @return 0, or -1 if there's no log or it isn't one.
+ */
+int readJournalHeader(const char *fileName, journalHeader *header) {
+	FILE *journal;
+	int valid;
+
+	if ((journal = fopen(fileName, "r")) == NULL)
+		return -1;
+	valid = fread(header, sizeof(journalHeader), 1, journal) == 1 && header->magic == JOURNAL_MAGIC;
+	fclose(journal);
+
+	if (!valid) {
+		fprintf(stderr, "%s is not a cache index log, starting empty\n", fileName);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Opens the index log for appending, starting it with a header for the current key hash if it's new.
+ * @return The descriptor, or -1 on error.
+ */
+int openJournal(const char *fileName) {
+	journalHeader header;
+	int fd;
+
+	if ((fd = open(fileName, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+		perror("Failed to open cache index log");
+		return -1;
+	}
+	fillHeader(&header);
+	if (lseek(fd, 0, SEEK_END) == 0 && writeAll(fd, &header, sizeof(header)) < 0) {
+		perror("Failed to start cache index log");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Records that cEntry was added or removed. Each record is a single write to an O_APPEND descriptor, so a crash can at
+ * worst leave the last one torn, which replayJournal() drops.
+ * @param type JOURNAL_ADD or JOURNAL_REMOVE.
+ */
+int appendJournal(int fd, int type, const cacheEntry *cEntry) {
+	journalRecord record;
+
+	fillRecord(&record, type, cEntry);
+	if (writeAll(fd, &record, sizeof(record)) < 0) {
+		perror("Failed to append to cache index log");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Hands every record of the log to apply in the order they were written. Its header is assumed to have been checked
+ * with readJournalHeader().
+ * @return Records read, or -1 if there's no log or it isn't one.
+ */
+long replayJournal(const char *fileName, void (*apply)(const journalRecord *record, void *arg), void *arg) {
+	journalHeader header;
+	journalRecord record;
+	long replayed = 0;
+	FILE *journal;
+
+	if ((journal = fopen(fileName, "r")) == NULL)
+		return -1;
+
+	if (fread(&header, sizeof(header), 1, journal) != 1 || header.magic != JOURNAL_MAGIC) {
+		fclose(journal);
+		return -1;
+	}
+
+	while (fread(&record, sizeof(record), 1, journal) == 1) {
+		if (record.type != JOURNAL_ADD && record.type != JOURNAL_REMOVE)
+			break;
+		record.validators.etag[VALIDATOR_BYTES - 1] = '\0';
+		record.validators.lastModified[VALIDATOR_BYTES - 1] = '\0';
+		apply(&record, arg);
+		replayed++;
+	}
+
+	fclose(journal);
+	return replayed;
+}
+
+/**
+ * Replaces the log with one add record per indexed entry, written to a temporary file and renamed over the old one so
+ * there's always a complete log on disk. The caller holds the index lock and must reopen the log afterwards.
+ * @return Records written, or -1 on error.
+ */
+int rewriteJournal(const char *fileName, cacheEntry **slots, int capacity) {
+	char tmpName[PATH_MAX];
+	journalHeader header;
+	journalRecord record;
+	int fd, i, written = 0, failed = 0;
+
+	snprintf(tmpName, PATH_MAX, "%s.tmp", fileName);
+	if ((fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("Failed to rewrite cache index log");
+		return -1;
+	}
+
+	fillHeader(&header);
+	failed = writeAll(fd, &header, sizeof(header)) < 0;
+	for (i = 0; i < capacity && !failed; i++) {
+		if (slots[i] == NULL)
+			continue;
+		fillRecord(&record, JOURNAL_ADD, slots[i]);
+		failed = writeAll(fd, &record, sizeof(record)) < 0;
+		written++;
+	}
+
+	if (close(fd) < 0 || failed || rename(tmpName, fileName) < 0) {
+		perror("Failed to rewrite cache index log");
+		remove(tmpName);
+		return -1;
+	}
+	return written;
+}
@@ -0,0 +1,48 @@
+//
+// Created by jmalcy on 12/04/20.
+//
+
+#ifndef HTTPPROXY_JOURNAL_H
+#define HTTPPROXY_JOURNAL_H
+
+#include <stdint.h>
+#include "cache.h"
+
+#define JOURNAL_MAGIC       0x33584449584f5250ULL  // "PROXIDX3", first eight bytes of every log
+#define JOURNAL_ADD         1  // the object under key is in the cache as described
+#define JOURNAL_REMOVE      2  // the object under key and its file are gone
+
+// starts every log, the keys in it only mean something hashed the same way
+typedef struct {
+	uint64_t magic;
+	uint32_t keyHash;  // KEY_HASH_*
+	uint32_t reserved;
+	uint64_t seed;
+} journalHeader;
+
+/**
+ * One fixed size record of the index log. A persistent cache directory holds the log next to the object files, replaying
+ * it from the start rebuilds the index: the last record for a key is the one that counts.
+ */
+typedef struct {
+	uint32_t type;
+	uint32_t framed;
+	uint8_t key[DIGEST_BYTES];
+	int64_t t;
+	int64_t expires;
+	int64_t staleGrace;
+	int64_t size;
+	cacheValidators validators;
+} journalRecord;
+
+int readJournalHeader(const char *fileName, journalHeader *header);
+
+int openJournal(const char *fileName);
+
+int appendJournal(int fd, int type, const cacheEntry *cEntry);
+
+long replayJournal(const char *fileName, void (*apply)(const journalRecord *record, void *arg), void *arg);
+
+int rewriteJournal(const char *fileName, cacheEntry **slots, int capacity);
+
+#endif //HTTPPROXY_JOURNAL_H
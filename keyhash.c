@@ -0,0 +1,221 @@
+//
+// Created by jmalcy on 12/05/20.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/random.h>
+#include "keyhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t laneRound(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t mergeLane(uint64_t h, uint64_t lane) {
+	h ^= laneRound(0, lane);
+	return h * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static void fastInit(keyHasher *hasher, uint64_t seed) {
+	fastHashState *s = &hasher->state.fast;
+
+	s->lanes[0] = seed + PRIME64_1 + PRIME64_2;
+	s->lanes[1] = seed + PRIME64_2;
+	s->lanes[2] = seed;
+	s->lanes[3] = seed - PRIME64_1;
+	s->stripeLength = 0;
+	s->total = 0;
+	s->seed = seed;
+}
+
+static void fastStripe(fastHashState *s, const uint8_t *p) {
+	s->lanes[0] = laneRound(s->lanes[0], read64(p));
+	s->lanes[1] = laneRound(s->lanes[1], read64(p + 8));
+	s->lanes[2] = laneRound(s->lanes[2], read64(p + 16));
+	s->lanes[3] = laneRound(s->lanes[3], read64(p + 24));
+}
+
+static void fastUpdate(keyHasher *hasher, const uint8_t *data, size_t len) {
+	fastHashState *s = &hasher->state.fast;
+	size_t take;
+
+	s->total += len;
+	if (s->stripeLength > 0) {
+		take = len < 32 - s->stripeLength ? len : 32 - s->stripeLength;
+		memcpy(s->stripe + s->stripeLength, data, take);
+		s->stripeLength += take;
+		data += take;
+		len -= take;
+		if (s->stripeLength < 32)
+			return;
+		fastStripe(s, s->stripe);
+		s->stripeLength = 0;
+	}
+
+	for (; len >= 32; data += 32, len -= 32)
+		fastStripe(s, data);
+
+	memcpy(s->stripe, data, len);
+	s->stripeLength = len;
+}
+
+/**
+ * The lanes fold into the lower half the way XXH64 does it. The upper half folds them in a different order and takes
+ * the tail through its own rounds, so short keys, which never fill a stripe, still get 128 bits that depend on every
+ * byte.
+ */
+static void fastFinal(keyHasher *hasher, uint8_t *digest) {
+	fastHashState *s = &hasher->state.fast;
+	const uint8_t *p = s->stripe;
+	size_t left = s->stripeLength;
+	uint64_t low, high, k;
+	int i;
+
+	if (s->total >= 32) {
+		low = rotl64(s->lanes[0], 1) + rotl64(s->lanes[1], 7) + rotl64(s->lanes[2], 12) + rotl64(s->lanes[3], 18);
+		high = rotl64(s->lanes[3], 3) + rotl64(s->lanes[2], 5) + rotl64(s->lanes[1], 13) + rotl64(s->lanes[0], 19);
+		for (i = 0; i < 4; i++) {
+			low = mergeLane(low, s->lanes[i]);
+			high = mergeLane(high, s->lanes[3 - i]);
+		}
+	} else {
+		low = s->seed + PRIME64_5;
+		high = s->seed ^ PRIME64_4;
+	}
+	low += s->total;
+	high += s->total * PRIME64_3;
+
+	for (; left >= 8; p += 8, left -= 8) {
+		k = read64(p);
+		low ^= laneRound(0, k);
+		low = rotl64(low, 27) * PRIME64_1 + PRIME64_4;
+		high ^= rotl64(k * PRIME64_3, 29) * PRIME64_1;
+		high = rotl64(high, 31) * PRIME64_2 + PRIME64_5;
+	}
+	if (left >= 4) {
+		k = read32(p);
+		low ^= k * PRIME64_1;
+		low = rotl64(low, 23) * PRIME64_2 + PRIME64_3;
+		high ^= k * PRIME64_2;
+		high = rotl64(high, 17) * PRIME64_1 + PRIME64_4;
+		p += 4;
+		left -= 4;
+	}
+	for (; left > 0; p++, left--) {
+		low ^= *p * PRIME64_5;
+		low = rotl64(low, 11) * PRIME64_1;
+		high ^= *p * PRIME64_1;
+		high = rotl64(high, 13) * PRIME64_5;
+	}
+
+	low = avalanche(low);
+	high = avalanche(high ^ low);
+	memcpy(digest, &low, sizeof(low));
+	memcpy(digest + 8, &high, sizeof(high));
+}
+
+// MD5 has no seed, keys come out the same in every directory
+static void md5HashInit(keyHasher *hasher, uint64_t seed) {
+	(void)seed;
+	md5Init(&hasher->state.md5);
+}
+
+static void md5HashUpdate(keyHasher *hasher, const uint8_t *data, size_t len) {
+	md5Update(&hasher->state.md5, data, len);
+}
+
+static void md5HashFinal(keyHasher *hasher, uint8_t *digest) {
+	md5Final(&hasher->state.md5, digest);
+}
+
+// indexed by KEY_HASH_*
+static const keyHashOps keyHashes[] = {
+		{"fast", fastInit, fastUpdate, fastFinal},
+		{"md5", md5HashInit, md5HashUpdate, md5HashFinal},
+};
+
+static int activeAlgorithm = KEY_HASH;
+static uint64_t activeSeed = 0;
+
+/**
+ * Picks how every cache key is hashed from here on. Called once before any request is parsed, keys made by different
+ * algorithms or seeds never match.
+ * @param algorithm KEY_HASH_FAST or KEY_HASH_MD5.
+ * @param seed Mixed into the fast hash so keys can't be predicted from outside, ignored by MD5.
+ */
+void setKeyHash(int algorithm, uint64_t seed) {
+	if (algorithm < 0 || algorithm >= (int)(sizeof(keyHashes) / sizeof(keyHashes[0])))
+		algorithm = KEY_HASH;
+	activeAlgorithm = algorithm;
+	activeSeed = seed;
+}
+
+int keyHashAlgorithm(void) {
+	return activeAlgorithm;
+}
+
+uint64_t keyHashSeed(void) {
+	return activeSeed;
+}
+
+const char *keyHashName(int algorithm) {
+	return keyHashes[algorithm].name;
+}
+
+// a seed for a new cache, from the kernel if it has one to give
+uint64_t randomKeySeed(void) {
+	uint64_t seed;
+
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+		seed = (uint64_t)time(NULL) * PRIME64_1 ^ (uint64_t)getpid() * PRIME64_2;
+	return seed;
+}
+
+void keyHashInit(keyHasher *hasher) {
+	hasher->ops = &keyHashes[activeAlgorithm];
+	hasher->ops->init(hasher, activeSeed);
+}
+
+void keyHashUpdate(keyHasher *hasher, const void *data, size_t len) {
+	hasher->ops->update(hasher, data, len);
+}
+
+// writes DIGEST_BYTES of digest
+void keyHashFinal(keyHasher *hasher, uint8_t *digest) {
+	hasher->ops->final(hasher, digest);
+}
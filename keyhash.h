@@ -0,0 +1,57 @@
+//
+// Created by jmalcy on 12/05/20.
+//
+
+#ifndef HTTPPROXY_KEYHASH_H
+#define HTTPPROXY_KEYHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "md5.h"
+#include "macro.h"
+
+// state of the fast hash, four lanes over 32 byte stripes and a second accumulator for the upper half of the digest
+typedef struct {
+	uint64_t lanes[4];
+	uint8_t stripe[32];  // the partial stripe not hashed yet
+	size_t stripeLength;
+	uint64_t total;
+	uint64_t seed;
+} fastHashState;
+
+struct keyHashOps;
+
+// a cache key being hashed piece by piece, never allocates
+typedef struct {
+	const struct keyHashOps *ops;
+	union {
+		md5Context md5;
+		fastHashState fast;
+	} state;
+} keyHasher;
+
+// one way of turning a key into DIGEST_BYTES of digest
+typedef struct keyHashOps {
+	const char *name;
+	void (*init)(keyHasher *hasher, uint64_t seed);
+	void (*update)(keyHasher *hasher, const uint8_t *data, size_t len);
+	void (*final)(keyHasher *hasher, uint8_t *digest);
+} keyHashOps;
+
+void setKeyHash(int algorithm, uint64_t seed);
+
+int keyHashAlgorithm(void);
+
+uint64_t keyHashSeed(void);
+
+const char *keyHashName(int algorithm);
+
+uint64_t randomKeySeed(void);
+
+void keyHashInit(keyHasher *hasher);
+
+void keyHashUpdate(keyHasher *hasher, const void *data, size_t len);
+
+void keyHashFinal(keyHasher *hasher, uint8_t *digest);
+
+#endif //HTTPPROXY_KEYHASH_H
@@ -0,0 +1,372 @@
+//
+// Created by jmalcy on 12/10/20.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "logger.h"
+
+// argument sizes as the format string says them, ints are widened to 64 bits either way
+#define ARG_INT             0
+#define ARG_LONG            1
+#define ARG_LONG_LONG       2
+#define ARG_SIZE            3
+
+static const char *levelNames[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+static struct {
+	logRing *rings;  // every thread that ever logged has one here
+	int level;
+	int running;
+	pthread_t writer;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+} logger = {.rings = NULL, .level = LOG_INFO, .running = 0};
+
+static __thread logRing *threadRing;  // the calling thread's, made on its first message
+
+// text on its way to one descriptor, written out whole once it fills or the writer runs out of messages
+typedef struct {
+	int fd;
+	size_t length;
+	char text[LOG_BATCH_BYTES];
+} logBatch;
+
+static logBatch outBatch = {.fd = STDOUT_FILENO}, errBatch = {.fd = STDERR_FILENO};
+
+static void *writeLogs(void *unused);
+
+// the calling thread's ring, made and linked in the first time it logs. Linking is a CAS, no thread ever locks.
+static logRing *ownRing(void) {
+	logRing *ring;
+
+	if (threadRing != NULL)
+		return threadRing;
+	if ((ring = calloc(1, sizeof(logRing))) == NULL)
+		return NULL;
+
+	ring->next = __atomic_load_n(&logger.rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&logger.rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	threadRing = ring;
+	return ring;
+}
+
+// how wide the argument of the conversion at *spec is, spec is moved past its flags, width and length modifier
+static int argSize(const char **spec) {
+	int size = ARG_INT;
+
+	for (;; (*spec)++) {
+		switch (**spec) {
+			case '-': case '+': case ' ': case '#': case '.':
+			case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+			case 'h':
+				break;
+			case 'l':
+				size = size == ARG_LONG ? ARG_LONG_LONG : ARG_LONG;
+				break;
+			case 'z': case 'j': case 't':
+				size = ARG_SIZE;
+				break;
+			default:
+				return size;
+		}
+	}
+}
+
+/**
+ * Copies what format refers to into the record: strings up to the room there is left, everything else as 8 bytes.
+ * Whatever doesn't fit is left out and the writer stops formatting where it runs out.
+ */
+static void packArgs(logRecord *record, const char *format, va_list args) {
+	char *out = record->args, *end = record->args + sizeof(record->args);
+	const char *spec, *string;
+	int64_t number;
+	double real;
+	size_t length;
+	int size;
+
+	for (spec = strchr(format, '%'); spec != NULL; spec = strchr(spec + 1, '%')) {
+		spec++;
+		size = argSize(&spec);
+
+		switch (*spec) {
+			case 's':
+				if ((string = va_arg(args, const char *)) == NULL)
+					string = "(null)";
+				if (out == end)
+					break;
+				length = strnlen(string, end - out - 1);
+				memcpy(out, string, length);
+				out[length] = '\0';
+				out += length + 1;
+				continue;
+			case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+				real = va_arg(args, double);
+				memcpy(&number, &real, sizeof(number));
+				break;
+			case 'p':
+				number = (int64_t)(intptr_t)va_arg(args, void *);
+				break;
+			case 'd': case 'i': case 'c': case 'o': case 'u': case 'x': case 'X':
+				if (size == ARG_LONG)
+					number = va_arg(args, long);
+				else if (size == ARG_LONG_LONG)
+					number = va_arg(args, long long);
+				else if (size == ARG_SIZE)
+					number = (int64_t)va_arg(args, size_t);
+				else if (*spec == 'd' || *spec == 'i')
+					number = va_arg(args, int);
+				else
+					number = va_arg(args, unsigned int);
+				break;
+			default:
+				continue;  // %% or something without an argument
+		}
+		if (end - out < (long)sizeof(number))
+			break;
+		memcpy(out, &number, sizeof(number));
+		out += sizeof(number);
+	}
+	record->length = out - record->args;
+}
+
+/**
+ * Queues a message for the writer thread. The format is kept by reference and the arguments by value, so formatting
+ * costs the caller nothing and a full ring costs it a dropped message, never a wait. Before startLogger() and after
+ * stopLogger() messages are printed directly instead. No trailing newline, every message is a line.
+ */
+void logMessage(int level, const char *format, ...) {
+	struct timespec now;
+	logRecord *record;
+	logRing *ring;
+	va_list args;
+	uint64_t head;
+
+	if (level < logger.level)
+		return;
+
+	va_start(args, format);
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) || (ring = ownRing()) == NULL) {
+		vfprintf(level >= LOG_WARN ? stderr : stdout, format, args);
+		fputc('\n', level >= LOG_WARN ? stderr : stdout);
+		va_end(args);
+		return;
+	}
+
+	head = ring->head;
+	if (head - ring->tailSeen == LOG_RING_SLOTS)
+		ring->tailSeen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - ring->tailSeen == LOG_RING_SLOTS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);  // the writer swaps it for 0 at the same time
+		va_end(args);
+		return;
+	}
+
+	record = &ring->records[head & (LOG_RING_SLOTS - 1)];
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	record->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	record->format = format;
+	record->level = level;
+	packArgs(record, format, args);
+	va_end(args);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// writes out a batch, retrying short writes. Nothing is left to tell if that fails.
+static void flushBatch(logBatch *batch) {
+	size_t written = 0;
+	ssize_t n;
+
+	while (written < batch->length) {
+		if ((n = write(batch->fd, batch->text + written, batch->length - written)) < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	batch->length = 0;
+}
+
+// printf onto the end of a batch, cut short if it's full
+static void appendBatch(logBatch *batch, const char *format, ...) {
+	va_list args;
+	int written;
+
+	va_start(args, format);
+	written = vsnprintf(batch->text + batch->length, LOG_BATCH_BYTES - batch->length, format, args);
+	va_end(args);
+	if (written > 0)
+		batch->length += (size_t)written < LOG_BATCH_BYTES - batch->length ? (size_t)written :
+				LOG_BATCH_BYTES - batch->length - 1;
+}
+
+// the record's format with its arguments put back in, one conversion at a time
+static void formatRecord(logBatch *batch, const logRecord *record) {
+	const char *args = record->args, *argsEnd = record->args + record->length, *text = record->format, *spec;
+	char conversion[32];
+	int64_t number;
+	double real;
+	size_t prefix;
+
+	while ((spec = strchr(text, '%')) != NULL) {
+		appendBatch(batch, "%.*s", (int)(spec - text), text);
+
+		// the flags, width and precision as given, the length modifier swapped for the 64 bit one the value has
+		text = spec + 1;
+		text += strspn(text, "-+ #0123456789.");
+		prefix = text - spec;
+		argSize(&text);
+		if (*text == '\0' || prefix + 4 > sizeof(conversion))
+			break;
+		memcpy(conversion, spec, prefix);
+
+		if (*text == '%') {
+			appendBatch(batch, "%%");
+		} else if (*text == 's') {
+			if (args >= argsEnd)
+				break;
+			strcpy(conversion + prefix, "s");
+			appendBatch(batch, conversion, args);
+			args += strlen(args) + 1;
+		} else if (strchr("fFeEgGpdicouxX", *text) != NULL) {
+			if (argsEnd - args < (long)sizeof(number))
+				break;
+			memcpy(&number, args, sizeof(number));
+			args += sizeof(number);
+			if (strchr("fFeEgG", *text) != NULL) {
+				memcpy(&real, &number, sizeof(real));
+				sprintf(conversion + prefix, "%c", *text);
+				appendBatch(batch, conversion, real);
+			} else if (*text == 'p') {
+				strcpy(conversion + prefix, "p");
+				appendBatch(batch, conversion, (void *)(intptr_t)number);
+			} else if (*text == 'c') {  // there's no long long char, it goes back to the int it was passed as
+				strcpy(conversion + prefix, "c");
+				appendBatch(batch, conversion, (int)number);
+			} else {
+				sprintf(conversion + prefix, "ll%c", *text);
+				appendBatch(batch, conversion, (long long)number);
+			}
+		}
+		text++;
+	}
+	if (spec == NULL)
+		appendBatch(batch, "%s", text);
+	appendBatch(batch, "\n");
+}
+
+// moves every message waiting in every ring into the batches, the timestamp is only worked out again each second
+static void drainRings(void) {
+	static time_t stampSecond = -1;
+	static char stamp[32];
+	struct tm local;
+	const logRecord *record;
+	logBatch *batch;
+	logRing *ring;
+	uint64_t tail, head, dropped;
+	time_t second;
+
+	for (ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			record = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+			batch = record->level >= LOG_WARN ? &errBatch : &outBatch;
+			if (batch->length > LOG_BATCH_BYTES - LOG_RECORD_BYTES * 4)
+				flushBatch(batch);
+
+			if ((second = record->time / 1000000000) != stampSecond) {
+				localtime_r(&second, &local);
+				strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+				stampSecond = second;
+			}
+			appendBatch(batch, "%s.%03d %s ", stamp, (int)(record->time / 1000000 % 1000),
+					levelNames[record->level]);
+			formatRecord(batch, record);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if ((dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED)) > 0)
+			appendBatch(&errBatch, "%lu log messages dropped, a thread logged faster than they could be written\n",
+					(unsigned long)dropped);
+	}
+	flushBatch(&outBatch);
+	flushBatch(&errBatch);
+}
+
+// Writer thread. Every LOG_FLUSH_MS it formats whatever the rings hold and writes it out in one go per descriptor.
+static void *writeLogs(void *unused) {
+	struct timespec wakeup;
+
+	(void)unused;
+
+	pthread_mutex_lock(&logger.mutex);
+	while (!logger.stop) {
+		pthread_mutex_unlock(&logger.mutex);
+		drainRings();
+		pthread_mutex_lock(&logger.mutex);
+
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		wakeup.tv_sec += wakeup.tv_nsec / 1000000000;
+		wakeup.tv_nsec %= 1000000000;
+		if (!logger.stop)
+			pthread_cond_timedwait(&logger.cond, &logger.mutex, &wakeup);
+	}
+	pthread_mutex_unlock(&logger.mutex);
+
+	drainRings();
+	return NULL;
+}
+
+/**
+ * Starts the writer thread, messages from then on are queued instead of printed.
+ * @param level Messages below it are dropped, LOG_*.
+ * @return 0, or -1 if the thread couldn't be started, in which case messages keep being printed directly.
+ */
+int startLogger(int level) {
+	logger.level = level;
+	logger.stop = 0;
+	pthread_mutex_init(&logger.mutex, NULL);
+	pthread_cond_init(&logger.cond, NULL);
+
+	if (pthread_create(&logger.writer, NULL, writeLogs, NULL) != 0) {
+		perror("Failed to start log writer");
+		return -1;
+	}
+	__atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Writes out everything queued and stops the writer. Every other thread that logs must be done by now, later messages
+ * are printed directly.
+ */
+void stopLogger(void) {
+	logRing *ring, *next;
+
+	if (!logger.running)
+		return;
+	pthread_mutex_lock(&logger.mutex);
+	logger.stop = 1;
+	pthread_cond_signal(&logger.cond);
+	pthread_mutex_unlock(&logger.mutex);
+	pthread_join(logger.writer, NULL);
+	__atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+
+	for (ring = logger.rings; ring != NULL; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	logger.rings = NULL;
+	threadRing = NULL;
+	pthread_mutex_destroy(&logger.mutex);
+	pthread_cond_destroy(&logger.cond);
+}
@@ -0,0 +1,50 @@
+//
+// Created by jmalcy on 12/10/20.
+//
+
+#ifndef HTTPPROXY_LOGGER_H
+#define HTTPPROXY_LOGGER_H
+
+#include <stdint.h>
+#include "macro.h"
+
+// how much a message matters, the writer drops anything below the level it was started with
+#define LOG_DEBUG           0
+#define LOG_INFO            1
+#define LOG_WARN            2  // and up go to stderr, the rest to stdout
+#define LOG_ERROR           3
+
+/**
+ * One message as its thread left it: the format string and the raw arguments it refers to, strings copied in and
+ * numbers widened to 64 bits. Nothing is formatted until the writer gets to it.
+ */
+typedef struct {
+	uint64_t time;  // CLOCK_REALTIME_COARSE nanoseconds, a few milliseconds is plenty for a log line
+	const char *format;  // must be a literal, the writer reads it later
+	uint32_t level;
+	uint32_t length;  // bytes of args in use
+	char args[LOG_RECORD_BYTES - 24];
+} logRecord;
+
+/**
+ * A thread's messages on their way to the writer. Only the owning thread moves head and only the writer moves tail, so
+ * neither ever waits on the other. A full ring drops the message rather than block the thread.
+ */
+typedef struct logRing {
+	logRecord records[LOG_RING_SLOTS];
+	struct logRing *next;  // every ring there is, newest first
+
+	// the owner's line and the writer's line, kept apart so they don't bounce between the two threads' caches
+	uint64_t head __attribute__((aligned(64)));  // next record the owner fills
+	uint64_t tailSeen;  // tail as the owner last read it, only reread once the ring looks full
+	uint64_t dropped;  // messages that found the ring full, reported by the writer
+	uint64_t tail __attribute__((aligned(64)));  // next record the writer formats
+} logRing;
+
+int startLogger(int level);
+
+void stopLogger(void);
+
+void logMessage(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif //HTTPPROXY_LOGGER_H
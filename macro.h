@@ -8,9 +8,88 @@
 #define MAXLINE     		8192  /* max text line length */
 #define MAXBUF      		8192  /* max I/O buffer size */
 #define LISTENQ     		1024  /* second argument to listen() */
-#define MAX_CACHE_ENTRIES   30
+#define MAXHOST             256   /* longest host name */
+#define MAX_HEADERS         64    /* headers a request may have */
+#define MAX_HEAD_BYTES      65536 /* longest request line and headers accepted */
 #define HEX_BYTES           32
+#define DIGEST_BYTES        16
+#define VALIDATOR_BYTES     128   /* longest ETag or Last-Modified value kept with an object */
+#define CACHE_SHARDS        16    /* independently locked parts of the cache, power of two */
+#define INITIAL_CACHE_SLOTS 64    /* per shard, must be a power of two */
+#define INFLIGHT_SLOTS      256   /* buckets of the in-flight fetch table */
+#define POOL_SLOTS          64    /* buckets of the upstream connection pool */
+#define POOL_MAX_IDLE       256   /* idle upstream connections kept in total */
+#define POOL_MAX_IDLE_HOST  8     /* idle upstream connections kept per host and port */
+#define POOL_IDLE_SECONDS   30    /* how long an idle upstream connection is kept */
+#define DNS_SLOTS           256   /* buckets of the resolved host table */
+#define DNS_MAX_ADDRS       8     /* addresses kept per host */
+#define DNS_TTL_SECONDS     300   /* how long a resolved host is trusted */
+#define DNS_NEGATIVE_SECONDS 30   /* how long a failed lookup is remembered */
+#define DNS_RESOLVERS       4     /* threads making blocking resolver calls */
+#define MEMORY_CACHE_MB     64    /* default budget of the in-memory tier */
+#define SLAB_BYTES          (1024 * 1024)
+#define SLAB_MIN_CHUNK      512
+#define SLAB_CLASSES        8     /* chunks of 512 B up to 64 KB, bigger objects stay on disk only */
+#define STALE_KEEP_SECONDS  600   /* how long an expired object with validators is kept to be revalidated */
+#define STALE_GRACE_SECONDS 0     /* default time an expired object is still served while it's refreshed, 0 for off */
+#define JOURNAL_COMPACT_RATIO 4   /* index log records per live entry before it's rewritten */
+#define WHEEL_SLOTS         1024  /* seconds covered by one turn of the expiry wheel, power of two */
 #define LOCK_ENABLED        0
 #define LOCK_DISABLED       1
+#define MAX_EVENTS          64    /* epoll events handled per wakeup */
+#define EPOLL_TIMEOUT_MS    1000  /* how often workers check for shutdown */
+#define URING_ENTRIES       1024  /* submissions an io_uring worker queues between waits */
+#define CLIENT_IDLE_SECONDS 15    /* how long a client connection may sit without a request */
+#define UPSTREAM_IDLE_SECONDS 30  /* how long a fetch may go without hearing from the destination before it fails */
+#define ARENA_BYTES         16384 /* kept per connection for what a request needs while it's served */
+#define STATS_PATH          "/__proxy/stats"  /* answered by the proxy itself, ?format=json for JSON */
+#define LOG_RING_SLOTS      1024  /* messages a thread can have waiting for the log writer, power of two */
+#define LOG_RECORD_BYTES    256   /* one message and its arguments, longer strings are cut short */
+#define LOG_BATCH_BYTES     65536 /* text the log writer collects before a write */
+#define LOG_FLUSH_MS        10    /* how often the log writer looks for messages */
+#define LOG_LEVEL           1     /* LOG_INFO, least important messages logged */
+
+/* how cache keys are hashed, see keyhash.c */
+#define KEY_HASH_FAST       0
+#define KEY_HASH_MD5        1
+#define KEY_HASH            KEY_HASH_FAST  /* what a new cache directory is keyed with */
+
+/* return codes for the non-blocking request stages */
+#define IO_ERROR            -1
+#define IO_DONE             0
+#define IO_AGAIN            1
+#define IO_FORBIDDEN        2
+#define IO_PARTIAL          3     /* made progress, call again */
+#define IO_RETRY            4     /* pooled connection was dead, try again on a new one */
+
+/* how a lookup that missed the index was resolved, and how an in-flight fetch ended */
+#define FETCH_HIT           0     /* it landed in the index after all */
+#define FETCH_LEADER        1     /* caller fetches it for everyone */
+#define FETCH_FOLLOWER      2     /* caller reads along with the leader */
+#define FETCH_RUNNING       3
+#define FETCH_DONE          4
+#define FETCH_FAILED        5
+#define FETCH_FORBIDDEN     6
+
+/* what the workers wait on their sockets with */
+#define BACKEND_EPOLL       0
+#define BACKEND_URING       1     /* io_uring, falls back to epoll where the kernel lacks it */
+
+/* where the request parser is */
+#define PARSE_REQUEST_LINE  0
+#define PARSE_HEADERS       1
+#define PARSE_DONE          2
+#define PARSE_INVALID       3
+
+/* how the end of a response body is found */
+#define FRAME_NONE          0     /* there is no body */
+#define FRAME_LENGTH        1     /* Content-Length */
+#define FRAME_CHUNKED       2     /* Transfer-Encoding: chunked */
+#define FRAME_CLOSE         3     /* runs until the destination closes the connection */
+
+/* how a host name lookup went */
+#define DNS_FAILED          -1
+#define DNS_FOUND           0
+#define DNS_PENDING         1     /* a resolver thread is on it, the waiter will be woken */
 
 #endif //HTTPPROXY_MACRO_H
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include "md5.h"
 #include "macro.h"
@@ -30,97 +31,120 @@ uint32_t to_int32(const uint8_t *bytes) {
 	       | ((uint32_t) bytes[3] << 24);
 }
 
-void md5(const uint8_t *initial_msg, size_t initial_len, uint8_t *digest) {
+// runs one 512-bit chunk through the four rounds
+static void md5Block(md5Context *ctx, const uint8_t *chunk) {
+	uint32_t w[16];
+	uint32_t a, b, c, d, i, f, g, temp;
 
-	// These vars will contain the hash
-	uint32_t h0, h1, h2, h3;
+	// break chunk into sixteen 32-bit words w[j], 0 ≤ j ≤ 15
+	for (i = 0; i < 16; i++)
+		w[i] = to_int32(chunk + i * 4);
+
+	// Initialize hash value for this chunk:
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+
+	// Main loop:
+	for (i = 0; i < 64; i++) {
+
+		if (i < 16) {
+			f = (b & c) | ((~b) & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | ((~d) & c);
+			g = (5 * i + 1) % 16;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+		} else {
+			f = c ^ (b | (~d));
+			g = (7 * i) % 16;
+		}
 
-	// Message (to prepare)
-	uint8_t *msg = NULL;
+		temp = d;
+		d = c;
+		c = b;
+		b = b + LEFTROTATE((a + f + k[i] + w[g]), r[i]);
+		a = temp;
 
-	size_t new_len, offset;
-	uint32_t w[16];
-	uint32_t a, b, c, d, i, f, g, temp;
+	}
+
+	// Add this chunk's hash to result so far:
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+}
 
+void md5Init(md5Context *ctx) {
 	// Initialize variables - simple count in nibbles:
-	h0 = 0x67452301;
-	h1 = 0xefcdab89;
-	h2 = 0x98badcfe;
-	h3 = 0x10325476;
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->blockLength = 0;
+	ctx->total = 0;
+}
+
+// hashes the message a piece at a time, only a partial chunk is ever held back
+void md5Update(md5Context *ctx, const uint8_t *msg, size_t len) {
+	size_t take;
+
+	ctx->total += len;
+	if (ctx->blockLength > 0) {
+		take = len < 64 - ctx->blockLength ? len : 64 - ctx->blockLength;
+		memcpy(ctx->block + ctx->blockLength, msg, take);
+		ctx->blockLength += take;
+		msg += take;
+		len -= take;
+		if (ctx->blockLength < 64)
+			return;
+		md5Block(ctx, ctx->block);
+		ctx->blockLength = 0;
+	}
+
+	for (; len >= 64; msg += 64, len -= 64)
+		md5Block(ctx, msg);
+
+	memcpy(ctx->block, msg, len);
+	ctx->blockLength = len;
+}
+
+void md5Final(md5Context *ctx, uint8_t *digest) {
+	uint64_t bits = ctx->total * 8;
 
 	//Pre-processing:
 	//append "1" bit to message
 	//append "0" bits until message length in bits ≡ 448 (mod 512)
 	//append length mod (2^64) to message
-
-	for (new_len = initial_len + 1; new_len % (512 / 8) != 448 / 8; new_len++);
-
-	msg = (uint8_t *) malloc(new_len + 8);
-	memcpy(msg, initial_msg, initial_len);
-	msg[initial_len] = 0x80; // append the "1" bit; most significant bit is "first"
-	for (offset = initial_len + 1; offset < new_len; offset++)
-		msg[offset] = 0; // append "0" bits
+	ctx->block[ctx->blockLength++] = 0x80; // append the "1" bit; most significant bit is "first"
+	if (ctx->blockLength > 56) {
+		bzero(ctx->block + ctx->blockLength, 64 - ctx->blockLength);
+		md5Block(ctx, ctx->block);
+		ctx->blockLength = 0;
+	}
+	bzero(ctx->block + ctx->blockLength, 56 - ctx->blockLength);
 
 	// append the len in bits at the end of the buffer.
-	to_bytes(initial_len * 8, msg + new_len);
-	// initial_len>>29 == initial_len*8>>32, but avoids overflow.
-	to_bytes(initial_len >> 29, msg + new_len + 4);
-
-	// Process the message in successive 512-bit chunks:
-	//for each 512-bit chunk of message:
-	for (offset = 0; offset < new_len; offset += (512 / 8)) {
-
-		// break chunk into sixteen 32-bit words w[j], 0 ≤ j ≤ 15
-		for (i = 0; i < 16; i++)
-			w[i] = to_int32(msg + offset + i * 4);
-
-		// Initialize hash value for this chunk:
-		a = h0;
-		b = h1;
-		c = h2;
-		d = h3;
-
-		// Main loop:
-		for (i = 0; i < 64; i++) {
-
-			if (i < 16) {
-				f = (b & c) | ((~b) & d);
-				g = i;
-			} else if (i < 32) {
-				f = (d & b) | ((~d) & c);
-				g = (5 * i + 1) % 16;
-			} else if (i < 48) {
-				f = b ^ c ^ d;
-				g = (3 * i + 5) % 16;
-			} else {
-				f = c ^ (b | (~d));
-				g = (7 * i) % 16;
-			}
-
-			temp = d;
-			d = c;
-			c = b;
-			b = b + LEFTROTATE((a + f + k[i] + w[g]), r[i]);
-			a = temp;
-
-		}
+	to_bytes((uint32_t) bits, ctx->block + 56);
+	to_bytes((uint32_t) (bits >> 32), ctx->block + 60);
+	md5Block(ctx, ctx->block);
 
-		// Add this chunk's hash to result so far:
-		h0 += a;
-		h1 += b;
-		h2 += c;
-		h3 += d;
-
-	}
+	//var char digest[16] := h0 append h1 append h2 append h3 //(Output is in little-endian)
+	to_bytes(ctx->h[0], digest);
+	to_bytes(ctx->h[1], digest + 4);
+	to_bytes(ctx->h[2], digest + 8);
+	to_bytes(ctx->h[3], digest + 12);
+}
 
-	// cleanup
-	free(msg);
+void md5(const uint8_t *initial_msg, size_t initial_len, uint8_t *digest) {
+	md5Context ctx;
 
-	//var char digest[16] := h0 append h1 append h2 append h3 //(Output is in little-endian)
-	to_bytes(h0, digest);
-	to_bytes(h1, digest + 4);
-	to_bytes(h2, digest + 8);
-	to_bytes(h3, digest + 12);
+	md5Init(&ctx);
+	md5Update(&ctx, initial_msg, initial_len);
+	md5Final(&ctx, digest);
 }
 
 // The following was coded by Jacob Malcy
@@ -129,22 +153,23 @@ char * md5Str(char *msg, char *strResult) {
 	if (msg == NULL || (msg != NULL && strlen(msg) == 0))
 		return NULL;
 
-	int i;
 	uint8_t uintResult[16];
 	size_t len = strlen(msg);
-	char *charCast;
-
-	bzero(strResult, HEX_BYTES + 1);  // clear out the result array
 
 	md5((uint8_t *) msg, len, uintResult);
 
-	// build result
-	for (i = 0; i < 16; i++) {
-		charCast = malloc(3);  // 2 hex + \0
-		bzero(charCast, 3);
-		snprintf(charCast, 3, "%2.2x", uintResult[i]);
-		strcat(strResult, charCast);
-		free(charCast);
+	return digestStr(uintResult, strResult);
+}
+
+// writes the 16 byte digest as 32 lowercase hex characters plus \0
+char * digestStr(const uint8_t *digest, char *strResult) {
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < DIGEST_BYTES; i++) {
+		strResult[2 * i] = hex[digest[i] >> 4];
+		strResult[2 * i + 1] = hex[digest[i] & 0xf];
 	}
+	strResult[HEX_BYTES] = '\0';
 	return strResult;
 }
@@ -36,12 +36,28 @@ const static uint32_t r[] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12,
 // leftrotate function definition
 #define LEFTROTATE(x, c) (((x) << (c)) | ((x) >> (32 - (c))))
 
+// state of a message being hashed piece by piece
+typedef struct {
+	uint32_t h[4];
+	uint8_t block[64];  // the partial chunk not hashed yet
+	size_t blockLength;
+	uint64_t total;
+} md5Context;
+
 void to_bytes(uint32_t val, uint8_t *bytes);
 
 uint32_t to_int32(const uint8_t *bytes);
 
+void md5Init(md5Context *ctx);
+
+void md5Update(md5Context *ctx, const uint8_t *msg, size_t len);
+
+void md5Final(md5Context *ctx, uint8_t *digest);
+
 void md5(const uint8_t *initial_msg, size_t initial_len, uint8_t *digest);
 
 char * md5Str(char *msg, char *result);
 
+char * digestStr(const uint8_t *digest, char *result);
+
 #endif //HTTPPROXY_MD5_H
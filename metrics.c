@@ -0,0 +1,164 @@
+//
+// Created by jmalcy on 12/09/20.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+#define METRICS_TEXT_BYTES  8192  /* more than the formatted page ever takes */
+
+static const char *counterNames[COUNTERS] = {
+	"requests", "hits", "memory_hits", "stale_hits", "misses", "coalesced", "refreshes", "forbidden", "errors",
+	"bytes_served"
+};
+
+static const char *histogramNames[HISTOGRAMS] = {"hit", "miss", "dns", "connect", "ttfb"};
+
+// what the stats page reports of every histogram
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *quantileNames[] = {"p50", "p90", "p99", "p999"};
+#define QUANTILES           4
+
+// microseconds on a clock that never jumps, for timing stages of a request
+uint64_t metricsClock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// the owning worker is the only writer, so a load and a store is enough for readers never to see a torn value
+static void bump(uint64_t *value, uint64_t amount) {
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+void countMetric(workerMetrics *metrics, int counter, uint64_t amount) {
+	bump(&metrics->counters[counter], amount);
+}
+
+static int bucketOf(uint64_t micros) {
+	int shift;
+
+	if (micros >= (uint64_t)1 << HISTOGRAM_MAX_BITS)
+		micros = ((uint64_t)1 << HISTOGRAM_MAX_BITS) - 1;
+	if (micros < (1 << HISTOGRAM_SUB_BITS))
+		return (int)micros;
+
+	// the top HISTOGRAM_SUB_BITS + 1 bits pick the bucket, the leading one picks the power of two
+	shift = 63 - __builtin_clzll(micros) - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((micros >> shift) - (1 << HISTOGRAM_SUB_BITS));
+}
+
+// the largest value that lands in bucket
+static uint64_t bucketTop(int bucket) {
+	int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+
+	if (shift < 0)
+		return bucket;
+	return (((uint64_t)(bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS) + 1) << shift) - 1;
+}
+
+void recordLatency(workerMetrics *metrics, int histogram, uint64_t micros) {
+	bump(&metrics->histograms[histogram][bucketOf(micros)], 1);
+}
+
+// adds one worker's numbers to total, which belongs to the caller
+void mergeMetrics(workerMetrics *total, const workerMetrics *metrics) {
+	int i, j;
+
+	for (i = 0; i < COUNTERS; i++)
+		total->counters[i] += __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED);
+	for (i = 0; i < HISTOGRAMS; i++) {
+		for (j = 0; j < HISTOGRAM_BUCKETS; j++)
+			total->histograms[i][j] += __atomic_load_n(&metrics->histograms[i][j], __ATOMIC_RELAXED);
+	}
+}
+
+// values recorded in a histogram, and the bucket tops at each of the reported quantiles and the maximum
+static uint64_t summarize(const uint64_t *histogram, uint64_t *values) {
+	uint64_t count = 0, seen = 0;
+	int i, q = 0;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += histogram[i];
+	memset(values, 0, sizeof(uint64_t) * (QUANTILES + 1));
+
+	for (i = 0; i < HISTOGRAM_BUCKETS && count > 0; i++) {
+		if (histogram[i] == 0)
+			continue;
+		seen += histogram[i];
+		for (; q < QUANTILES && seen >= quantiles[q] * count; q++)
+			values[q] = bucketTop(i);
+		values[QUANTILES] = bucketTop(i);
+	}
+	return count;
+}
+
+// printf onto the end of the stats page, anything past its end is dropped
+static void appendText(char *text, size_t *used, const char *format, ...) {
+	va_list args;
+	int written;
+
+	if (*used >= METRICS_TEXT_BYTES - 1)
+		return;
+	va_start(args, format);
+	written = vsnprintf(text + *used, METRICS_TEXT_BYTES - *used, format, args);
+	va_end(args);
+	*used += written < (int)(METRICS_TEXT_BYTES - *used) ? (size_t)written : METRICS_TEXT_BYTES - 1 - *used;
+}
+
+/**
+ * Renders merged metrics for the stats page, as "name value" lines in the Prometheus text format or as one JSON object.
+ * @param length Set to the length of what's returned.
+ * @return A buffer the caller frees, or NULL if it couldn't be allocated.
+ */
+char *formatMetrics(const workerMetrics *total, int json, size_t *length) {
+	const uint64_t *counters = total->counters;
+	uint64_t values[QUANTILES + 1], count;
+	double hitRatio = counters[COUNTER_REQUESTS] > 0 ?
+			(double)counters[COUNTER_HITS] / counters[COUNTER_REQUESTS] : 0;
+	size_t used = 0;
+	char *text;
+	int i, q;
+
+	if ((text = malloc(METRICS_TEXT_BYTES)) == NULL) {
+		perror("Failed to allocate stats page");
+		return NULL;
+	}
+
+	if (json)
+		appendText(text, &used, "{");
+	for (i = 0; i < COUNTERS; i++) {
+		if (json)
+			appendText(text, &used, "\"%s\":%lu,", counterNames[i], (unsigned long)counters[i]);
+		else
+			appendText(text, &used, "proxy_%s_total %lu\n", counterNames[i], (unsigned long)counters[i]);
+	}
+	appendText(text, &used, json ? "\"hit_ratio\":%.4f,\"latency_us\":{" : "proxy_hit_ratio %.4f\n", hitRatio);
+
+	for (i = 0; i < HISTOGRAMS; i++) {
+		count = summarize(total->histograms[i], values);
+		if (json) {
+			appendText(text, &used, "%s\"%s\":{\"count\":%lu", i > 0 ? "," : "", histogramNames[i],
+					(unsigned long)count);
+			for (q = 0; q < QUANTILES; q++)
+				appendText(text, &used, ",\"%s\":%lu", quantileNames[q], (unsigned long)values[q]);
+			appendText(text, &used, ",\"max\":%lu}", (unsigned long)values[QUANTILES]);
+		} else {
+			for (q = 0; q < QUANTILES; q++)
+				appendText(text, &used, "proxy_%s_latency_us{quantile=\"%g\"} %lu\n", histogramNames[i],
+						quantiles[q], (unsigned long)values[q]);
+			appendText(text, &used, "proxy_%s_latency_us_max %lu\n", histogramNames[i],
+					(unsigned long)values[QUANTILES]);
+			appendText(text, &used, "proxy_%s_latency_us_count %lu\n", histogramNames[i], (unsigned long)count);
+		}
+	}
+	if (json)
+		appendText(text, &used, "}}\n");
+
+	*length = used;
+	return text;
+}
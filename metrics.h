@@ -0,0 +1,60 @@
+//
+// Created by jmalcy on 12/09/20.
+//
+
+#ifndef HTTPPROXY_METRICS_H
+#define HTTPPROXY_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// what every worker counts
+#define COUNTER_REQUESTS    0
+#define COUNTER_HITS        1  // answered from the cache, fresh or stale
+#define COUNTER_MEMORY_HITS 2  // of those, straight from the in-memory tier
+#define COUNTER_STALE_HITS  3  // of those, expired and inside the grace window
+#define COUNTER_MISSES      4  // fetched from the destination for this client
+#define COUNTER_COALESCED   5  // read along with another client's fetch of the same object
+#define COUNTER_REFRESHES   6  // background fetches of stale objects
+#define COUNTER_FORBIDDEN   7
+#define COUNTER_ERRORS      8  // connections dropped on a malformed request or a failure
+#define COUNTER_BYTES_SERVED 9
+#define COUNTERS            10
+
+// what every worker times, in microseconds
+#define HISTOGRAM_HIT       0  // request parsed to reply sent, for hits
+#define HISTOGRAM_MISS      1  // likewise for misses, leading or following a fetch
+#define HISTOGRAM_DNS       2  // looking up the destination
+#define HISTOGRAM_CONNECT   3  // getting a connection to it and the request written
+#define HISTOGRAM_TTFB      4  // request written to response head in
+#define HISTOGRAMS          5
+
+/**
+ * Log-linear buckets like an HDR histogram: values under 2^HISTOGRAM_SUB_BITS get a bucket each, every power of two
+ * above that is split into 2^HISTOGRAM_SUB_BITS buckets, so any value is known to within about 6%. Covers up to
+ * 2^HISTOGRAM_MAX_BITS microseconds, about 19 hours.
+ */
+#define HISTOGRAM_SUB_BITS  4
+#define HISTOGRAM_MAX_BITS  36
+#define HISTOGRAM_BUCKETS   ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/**
+ * One worker's counters and histograms. Only the worker ever writes them, with plain relaxed stores, and the stats page
+ * reads every worker's with relaxed loads, so counting costs no locks and no atomic read-modify-writes.
+ */
+typedef struct {
+	uint64_t counters[COUNTERS];
+	uint64_t histograms[HISTOGRAMS][HISTOGRAM_BUCKETS];
+} workerMetrics;
+
+uint64_t metricsClock(void);
+
+void countMetric(workerMetrics *metrics, int counter, uint64_t amount);
+
+void recordLatency(workerMetrics *metrics, int histogram, uint64_t micros);
+
+void mergeMetrics(workerMetrics *total, const workerMetrics *metrics);
+
+char *formatMetrics(const workerMetrics *total, int json, size_t *length);
+
+#endif //HTTPPROXY_METRICS_H
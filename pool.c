@@ -0,0 +1,138 @@
+//
+// Created by jmalcy on 11/28/20.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "pool.h"
+
+struct upstreamPool *initPool(int maxIdle, int maxIdlePerHost, int idleTimeout) {
+	struct upstreamPool *pool;
+
+	if ((pool = calloc(1, sizeof(struct upstreamPool))) == NULL) {
+		perror("Failed to allocate connection pool");
+		return NULL;
+	}
+	pool->maxIdle = maxIdle;
+	pool->maxIdlePerHost = maxIdlePerHost;
+	pool->idleTimeout = idleTimeout;
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	return pool;
+}
+
+// djb2 over host then port
+static idleConnection **poolBucket(struct upstreamPool *pool, const char *host, int port) {
+	unsigned long h = 5381;
+
+	while (*host)
+		h = h * 33 + (unsigned char)*host++;
+	h = h * 33 + (unsigned long)port;
+	return &pool->buckets[h % POOL_SLOTS];
+}
+
+// an idle connection the destination closed, or sent something unasked, can't be reused
+static int stillOpen(int fd) {
+	char peek;
+	ssize_t got = recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+	return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * Takes an idle connection to host:port out of the pool. Stale and dead connections met along the way are closed.
+ * @return A connected non-blocking socket, or -1 if there's none to reuse.
+ */
+int checkoutConnection(struct upstreamPool *pool, const char *host, int port) {
+	idleConnection **link, *idle;
+	time_t now = time(NULL);
+	int fd = -1;
+
+	pthread_mutex_lock(&pool->mutex);
+	link = poolBucket(pool, host, port);
+	while (fd < 0 && (idle = *link) != NULL) {
+		if (idle->port != port || strcmp(idle->host, host) != 0) {
+			link = &idle->next;
+			continue;
+		}
+
+		*link = idle->next;
+		pool->idleCount--;
+		if (now - idle->since < pool->idleTimeout && stillOpen(idle->fd))
+			fd = idle->fd;
+		else
+			close(idle->fd);
+		free(idle);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return fd;
+}
+
+/**
+ * Hands a connection whose last response was fully read back to the pool, or closes it if host:port or the pool as a
+ * whole already has as many idle connections as allowed.
+ */
+void checkinConnection(struct upstreamPool *pool, const char *host, int port, int fd) {
+	idleConnection **bucket, **link, *idle, *other;
+	time_t now = time(NULL);
+	int perHost = 0;
+
+	if (strlen(host) >= MAXHOST || (idle = malloc(sizeof(idleConnection))) == NULL) {
+		close(fd);
+		return;
+	}
+	strcpy(idle->host, host);
+	idle->port = port;
+	idle->fd = fd;
+	idle->since = now;
+
+	// count this host's idle connections, closing any in the bucket that have sat too long
+	pthread_mutex_lock(&pool->mutex);
+	bucket = poolBucket(pool, host, port);
+	link = bucket;
+	while ((other = *link) != NULL) {
+		if (now - other->since >= pool->idleTimeout) {
+			*link = other->next;
+			pool->idleCount--;
+			close(other->fd);
+			free(other);
+			continue;
+		}
+		if (other->port == port && strcmp(other->host, host) == 0)
+			perHost++;
+		link = &other->next;
+	}
+
+	if (perHost >= pool->maxIdlePerHost || pool->idleCount >= pool->maxIdle) {
+		pthread_mutex_unlock(&pool->mutex);
+		close(fd);
+		free(idle);
+		return;
+	}
+
+	idle->next = *bucket;
+	*bucket = idle;
+	pool->idleCount++;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// closes every idle connection and frees the pool
+void clearPool(struct upstreamPool *pool) {
+	int i;
+	idleConnection *idle, *next;
+
+	for (i = 0; i < POOL_SLOTS; i++) {
+		for (idle = pool->buckets[i]; idle != NULL; idle = next) {
+			next = idle->next;
+			close(idle->fd);
+			free(idle);
+		}
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
@@ -0,0 +1,42 @@
+//
+// Created by jmalcy on 11/28/20.
+//
+
+#ifndef HTTPPROXY_POOL_H
+#define HTTPPROXY_POOL_H
+
+#include <pthread.h>
+#include <time.h>
+#include "macro.h"
+
+// an open keep-alive connection to a destination, waiting for its next request
+typedef struct idleConnection {
+	char host[MAXHOST];
+	int port;
+	int fd;
+	time_t since;
+	struct idleConnection *next;
+} idleConnection;
+
+/**
+ * Idle upstream connections shared by every worker, chained by (host, port). A connection is only ever in the pool or
+ * owned by exactly one request, never both.
+ */
+struct upstreamPool {
+	idleConnection *buckets[POOL_SLOTS];
+	int idleCount;
+	int maxIdle;
+	int maxIdlePerHost;
+	int idleTimeout;  // seconds an idle connection is kept before it's closed
+	pthread_mutex_t mutex;
+};
+
+struct upstreamPool *initPool(int maxIdle, int maxIdlePerHost, int idleTimeout);
+
+int checkoutConnection(struct upstreamPool *pool, const char *host, int port);
+
+void checkinConnection(struct upstreamPool *pool, const char *host, int port, int fd);
+
+void clearPool(struct upstreamPool *pool);
+
+#endif //HTTPPROXY_POOL_H
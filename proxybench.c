@@ -0,0 +1,378 @@
+//
+// Created by jmalcy on 12/08/20.
+//
+
+/**
+ * proxybench.c - Load generator for the proxy with its own origin server, so a change can be measured with no network.
+ * The origin runs in this process on a loopback port and serves numbered objects of a fixed size after an optional
+ * delay. Many keep-alive clients ask the proxy for them at random as fast as it answers, and at the end the
+ * throughput, latency percentiles and hit ratio are printed. A request counts as a miss if it reached the origin.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_HEAD_BYTES    4096  /* longest head either side sends */
+#define BENCH_BODY_CHUNK    65536 /* body bytes read at a time */
+
+// what's being measured, from the command line
+static struct {
+	int proxyPort;
+	int clients;
+	int seconds;
+	int objects;
+	size_t objectBytes;
+	int latencyMs;  // the origin waits this long before each response
+	int originPort;
+	char *body;  // what every object consists of
+} bench = {0, 64, 10, 1000, 4096, 0, 0, NULL};
+
+// one client's results, only touched by its own thread until it's joined
+typedef struct {
+	pthread_t id;
+	unsigned int seed;
+	long *samples;  // microseconds per request
+	long sampleCount;
+	long sampleCapacity;
+	long errors;
+} benchClient;
+
+static long originRequests = 0;  // responses the origin has sent, every one of them a proxy miss
+static struct timespec deadline;
+
+static long elapsedMicros(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int pastDeadline(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return elapsedMicros(&deadline, &now) >= 0;
+}
+
+// the whole buffer or nothing, short writes are retried
+static int sendAll(int fd, const char *buf, size_t len) {
+	ssize_t sent;
+
+	while (len > 0) {
+		if ((sent = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+/**
+ * Reads from fd until buf holds a complete head.
+ * @param length Bytes already in buf, updated with what was read. Anything after the head is left in buf.
+ * @return Length of the head including its empty line, 0 if the peer closed first, -1 on error.
+ */
+static ssize_t readHead(int fd, char *buf, size_t *length) {
+	char *end;
+	ssize_t got;
+
+	while ((end = memmem(buf, *length, "\r\n\r\n", 4)) == NULL) {
+		if (*length == BENCH_HEAD_BYTES)
+			return -1;
+		if ((got = recv(fd, buf + *length, BENCH_HEAD_BYTES - *length, 0)) < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return got;
+		*length += got;
+	}
+	return end - buf + 4;
+}
+
+// the origin's end of one connection from the proxy, answering every request sent on it
+static void *serveOrigin(void *vConnfd) {
+	int connfd = (int)(long)vConnfd, headBytes;
+	char buf[BENCH_HEAD_BYTES], head[256];
+	struct timespec delay = {bench.latencyMs / 1000, (bench.latencyMs % 1000) * 1000000L};
+	size_t length = 0;
+	ssize_t headLength;
+
+	headBytes = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+			"Cache-Control: max-age=3600\r\n\r\n", bench.objectBytes);
+
+	while ((headLength = readHead(connfd, buf, &length)) > 0) {
+		if (bench.latencyMs > 0)
+			nanosleep(&delay, NULL);
+		if (sendAll(connfd, head, headBytes) < 0 || sendAll(connfd, bench.body, bench.objectBytes) < 0)
+			break;
+		__atomic_add_fetch(&originRequests, 1, __ATOMIC_RELAXED);
+
+		// GETs have no body, whatever follows the head is the next request
+		length -= headLength;
+		memmove(buf, buf + headLength, length);
+	}
+
+	close(connfd);
+	return NULL;
+}
+
+// accepts the proxy's connections to the origin, a thread for each
+static void *runOrigin(void *vListenfd) {
+	int listenfd = (int)(long)vListenfd, connfd;
+	pthread_t tid;
+
+	while (1) {
+		if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Origin failed to accept");
+			return NULL;
+		}
+		if (pthread_create(&tid, NULL, serveOrigin, (void *)(long)connfd) != 0) {
+			perror("Failed to start origin connection thread");
+			close(connfd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+}
+
+/**
+ * Listens on an ephemeral loopback port and starts the origin's accept thread.
+ * @return 0 with bench.originPort set, or -1 on error.
+ */
+static int startOrigin(void) {
+	struct sockaddr_in addr;
+	socklen_t addrLength = sizeof(addr);
+	pthread_t tid;
+	int listenfd;
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+			bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 1024) < 0 ||
+			getsockname(listenfd, (struct sockaddr *)&addr, &addrLength) < 0) {
+		perror("Failed to start origin");
+		return -1;
+	}
+	bench.originPort = ntohs(addr.sin_port);
+
+	if (pthread_create(&tid, NULL, runOrigin, (void *)(long)listenfd) != 0) {
+		perror("Failed to start origin thread");
+		close(listenfd);
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+static int connectProxy(void) {
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(bench.proxyPort);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void recordSample(benchClient *client, long micros) {
+	long *grown;
+
+	if (client->sampleCount == client->sampleCapacity) {
+		client->sampleCapacity = client->sampleCapacity > 0 ? client->sampleCapacity * 2 : 4096;
+		if ((grown = realloc(client->samples, client->sampleCapacity * sizeof(long))) == NULL) {
+			client->sampleCapacity = client->sampleCount;
+			return;
+		}
+		client->samples = grown;
+	}
+	client->samples[client->sampleCount++] = micros;
+}
+
+/**
+ * Sends one request for a random object on fd and reads the whole response.
+ * @return 0 if a complete 200 came back, -1 otherwise, in which case the connection is no good any more.
+ */
+static int fetchObject(benchClient *client, int fd) {
+	char request[256], head[BENCH_HEAD_BYTES], body[BENCH_BODY_CHUNK];
+	const char *lengthHeader;
+	size_t length = 0;
+	ssize_t headLength, got;
+	long remaining;
+	int requestLength, object = rand_r(&client->seed) % bench.objects;
+
+	requestLength = snprintf(request, sizeof(request),
+			"GET http://127.0.0.1:%d/object/%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+			bench.originPort, object, bench.originPort);
+	if (sendAll(fd, request, requestLength) < 0 || (headLength = readHead(fd, head, &length)) <= 0)
+		return -1;
+
+	head[headLength - 1] = '\0';
+	if (strncmp(head, "HTTP/1.1 200", 12) != 0 || (lengthHeader = strcasestr(head, "\r\nContent-Length:")) == NULL)
+		return -1;
+
+	// a response is never pipelined behind, so whatever came with the head is body
+	remaining = strtol(lengthHeader + 17, NULL, 10) - (long)(length - headLength);
+	while (remaining > 0) {
+		if ((got = recv(fd, body, remaining < BENCH_BODY_CHUNK ? remaining : BENCH_BODY_CHUNK, 0)) < 0 &&
+				errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		remaining -= got;
+	}
+	return remaining == 0 ? 0 : -1;
+}
+
+// one keep-alive client, requesting back to back until the deadline and reconnecting whenever the proxy hangs up
+static void *runClient(void *vClient) {
+	benchClient *client = (benchClient *)vClient;
+	struct timespec start, end;
+	int fd = -1;
+
+	while (!pastDeadline()) {
+		if (fd < 0 && (fd = connectProxy()) < 0) {
+			client->errors++;
+			usleep(10000);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (fetchObject(client, fd) < 0) {
+			client->errors++;
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		recordSample(client, elapsedMicros(&start, &end));
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static int compareLong(const void *a, const void *b) {
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+// the sample at quantile q of sorted, nearest rank
+static long percentile(const long *sorted, long count, double q) {
+	long rank = (long)(q * count + 0.5);
+
+	if (count == 0)
+		return 0;
+	if (rank < 1)
+		rank = 1;
+	return sorted[(rank > count ? count : rank) - 1];
+}
+
+int main(int argc, char **argv) {
+	benchClient *clients;
+	struct timespec started, finished;
+	long *samples, total = 0, errors = 0, misses, i, j;
+	double seconds;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (argc < 2 || argc > 7) {
+		fprintf(stderr, "usage: %s <proxy port> [clients] [seconds] [objects] [object bytes] [origin latency ms]\n",
+				argv[0]);
+		exit(0);
+	}
+	bench.proxyPort = atoi(argv[1]);
+	if (argc >= 3)
+		bench.clients = atoi(argv[2]);
+	if (argc >= 4)
+		bench.seconds = atoi(argv[3]);
+	if (argc >= 5)
+		bench.objects = atoi(argv[4]);
+	if (argc >= 6)
+		bench.objectBytes = strtoul(argv[5], NULL, 10);
+	if (argc == 7)
+		bench.latencyMs = atoi(argv[6]);
+
+	if (bench.proxyPort < 1 || bench.proxyPort > 65535 || bench.clients <= 0 || bench.seconds <= 0 ||
+			bench.objects <= 0 || bench.latencyMs < 0) {
+		fprintf(stderr, "Invalid arguments, see usage\n");
+		return 1;
+	}
+
+	if ((bench.body = malloc(bench.objectBytes + 1)) == NULL ||
+			(clients = calloc(bench.clients, sizeof(benchClient))) == NULL) {
+		perror("Failed to allocate benchmark");
+		return 1;
+	}
+	memset(bench.body, 'x', bench.objectBytes);
+
+	if (startOrigin() < 0)
+		return 1;
+	printf("Origin on port %d: %d objects of %zu bytes, %d ms latency\n", bench.originPort, bench.objects,
+			bench.objectBytes, bench.latencyMs);
+	printf("Driving proxy on port %d with %d clients for %d s\n", bench.proxyPort, bench.clients, bench.seconds);
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	deadline = started;
+	deadline.tv_sec += bench.seconds;
+	for (i = 0; i < bench.clients; i++) {
+		clients[i].seed = (unsigned int)(i * 2654435761u + started.tv_nsec);
+		if (pthread_create(&clients[i].id, NULL, runClient, &clients[i]) != 0) {
+			perror("Failed to start client thread");
+			return 1;
+		}
+	}
+	for (i = 0; i < bench.clients; i++) {
+		pthread_join(clients[i].id, NULL);
+		total += clients[i].sampleCount;
+		errors += clients[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	seconds = elapsedMicros(&started, &finished) / 1e6;
+
+	// every client's latencies together, sorted for the percentiles
+	if ((samples = malloc((total > 0 ? total : 1) * sizeof(long))) == NULL) {
+		perror("Failed to allocate samples");
+		return 1;
+	}
+	for (i = 0, j = 0; i < bench.clients; i++) {
+		memcpy(samples + j, clients[i].samples, clients[i].sampleCount * sizeof(long));
+		j += clients[i].sampleCount;
+		free(clients[i].samples);
+	}
+	qsort(samples, total, sizeof(long), compareLong);
+
+	misses = __atomic_load_n(&originRequests, __ATOMIC_RELAXED);
+	printf("Requests:   %ld completed, %ld failed\n", total, errors);
+	printf("Throughput: %.0f req/s, %.1f MB/s\n", total / seconds, total * (double)bench.objectBytes / seconds / 1e6);
+	printf("Latency:    p50 %ld us, p99 %ld us, p999 %ld us, max %ld us\n", percentile(samples, total, 0.5),
+			percentile(samples, total, 0.99), percentile(samples, total, 0.999), total > 0 ? samples[total - 1] : 0);
+	printf("Hit ratio:  %.2f%% (%ld of the requests reached the origin)\n",
+			total > 0 ? 100.0 * (total - (misses < total ? misses : total)) / total : 0.0, misses);
+
+	free(samples);
+	free(clients);
+	free(bench.body);
+	return 0;
+}
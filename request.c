@@ -2,12 +2,16 @@
 // Created by jmalcy on 11/16/20.
 //
 
+#define _GNU_SOURCE
 #include <strings.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <linux/limits.h>
 #include <arpa/inet.h>
@@ -18,303 +22,754 @@
 #include "request.h"
 #include "cache.h"
 #include "md5.h"
+#include "keyhash.h"
+#include "logger.h"
+
+// a header line of the request, as offsets into originalBuffer
+static int parseHeaderLine(request *req, size_t start, size_t end) {
+	char *buffer = req->originalBuffer;
+	char *colon;
+	httpHeader *header;
+
+	if (req->headerCount == MAX_HEADERS || buffer[start] == ' ' || buffer[start] == '\t')
+		return -1;  // too many, or an obsolete folded line
+	if ((colon = memchr(buffer + start, ':', end - start)) == NULL || colon == buffer + start)
+		return -1;
+
+	header = &req->headers[req->headerCount++];
+	header->name.offset = start;
+	header->name.length = colon - (buffer + start);
+
+	// the value without the whitespace around it
+	start = colon - buffer + 1;
+	while (start < end && (buffer[start] == ' ' || buffer[start] == '\t'))
+		start++;
+	while (end > start && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t'))
+		end--;
+	header->value.offset = start;
+	header->value.length = end - start;
+	return 0;
+}
 
-char * readRequest(int connfd, request *req) {
-	int currentMax = MAXBUF;
-	char recvBuffer[MAXBUF];
-	req->originalBuffer = (char *)malloc(sizeof(char) * currentMax);
-
-	bzero(req->originalBuffer, currentMax);  // fill receiveBuffer with \0
-	bzero(recvBuffer, currentMax);
-	int numReceived = 0, currentReadNum;
+// "method target version", each separated by a single space
+static int parseRequestLine(request *req, size_t start, size_t end) {
+	char *buffer = req->originalBuffer, *space;
+
+	if ((space = memchr(buffer + start, ' ', end - start)) == NULL || space == buffer + start)
+		return -1;
+	req->methodSpan.offset = start;
+	req->methodSpan.length = space - (buffer + start);
+
+	start = space - buffer + 1;
+	if ((space = memchr(buffer + start, ' ', end - start)) == NULL || space == buffer + start)
+		return -1;
+	req->targetSpan.offset = start;
+	req->targetSpan.length = space - (buffer + start);
+
+	start = space - buffer + 1;
+	if (start == end)
+		return -1;
+	req->versionSpan.offset = start;
+	req->versionSpan.length = end - start;
+	return 0;
+}
 
-	do {
-		// read in some bytes from the user
-		bzero(recvBuffer, MAXBUF);
-		currentReadNum = recv(connfd, recvBuffer, MAXBUF, 0);
+/**
+ * Runs the parser over every complete line that arrived since the last call, so each byte is looked at once however
+ * the request was split across reads. Lines may end in \r\n or a bare \n.
+ */
+static void parseRequestHead(request *req) {
+	char *buffer = req->originalBuffer, *newline;
+	size_t end;
+
+	while (req->parseState < PARSE_DONE &&
+			(newline = memchr(buffer + req->scanned, '\n', req->length - req->scanned)) != NULL) {
+		req->scanned = newline - buffer + 1;
+		end = newline - buffer;
+		if (end > req->lineStart && buffer[end - 1] == '\r')
+			end--;
+
+		if (req->parseState == PARSE_REQUEST_LINE) {
+			if (end > req->lineStart)  // stray empty lines before a request are allowed
+				req->parseState = parseRequestLine(req, req->lineStart, end) < 0 ? PARSE_INVALID : PARSE_HEADERS;
+		} else if (end == req->lineStart) {  // the empty line ending the head
+			req->consumed = req->scanned;
+			req->parseState = PARSE_DONE;
+		} else if (parseHeaderLine(req, req->lineStart, end) < 0) {
+			req->parseState = PARSE_INVALID;
+		}
+		req->lineStart = req->scanned;
+	}
 
-		if (currentReadNum > 0) {
-			numReceived += currentReadNum;
+	// everything buffered belongs to this head until it's done
+	if ((req->parseState == PARSE_DONE && req->consumed > MAX_HEAD_BYTES) ||
+			(req->parseState < PARSE_DONE && req->length > MAX_HEAD_BYTES))
+		req->parseState = PARSE_INVALID;
+	else if (req->parseState < PARSE_DONE)
+		req->scanned = req->length;
+}
 
-			while (numReceived > currentMax) {  // grow buffer to meet demand of newly read data
-				currentMax *= 2;
-				req->originalBuffer = (char *) realloc(req->originalBuffer, sizeof(char) * currentMax);
+/**
+ * Reads from the client until the head of the next request is in req->originalBuffer, parsing as it goes.
+ * The socket is non-blocking, so this can be called again on the next edge and carries on where it stopped. Reads
+ * take as much as fits in the buffer, so they can run past the end of the head into whatever the client pipelined
+ * after it. Those bytes stay in the buffer past req->consumed, and nextRequest() moves them to the front for the next
+ * request to start from.
+ * @return IO_DONE once the head is complete or known to be malformed, IO_AGAIN if more is needed, IO_ERROR otherwise.
+ */
+int readRequest(int connfd, request *req) {
+	ssize_t currentReadNum;
+	char *grown;
+
+	if (req->originalBuffer == NULL) {
+		req->capacity = MAXBUF;
+		req->length = 0;
+		if ((req->originalBuffer = malloc(req->capacity + 1)) == NULL) {
+			perror("Failed to allocate request buffer");
+			return IO_ERROR;
+		}
+		req->originalBuffer[0] = '\0';
+	}
 
-				if (req->originalBuffer == NULL) {
-					perror("Failed to allocate buffer to meet client demands.");
-					return NULL;
-				}
+	parseRequestHead(req);
+	while (req->parseState < PARSE_DONE) {
+		if (req->length == req->capacity) {  // grow buffer to meet demand of newly read data
+			if ((grown = realloc(req->originalBuffer, req->capacity * 2 + 1)) == NULL) {
+				perror("Failed to allocate buffer to meet client demands.");
+				return IO_ERROR;
 			}
+			req->originalBuffer = grown;
+			req->capacity *= 2;
+		}
+
+		currentReadNum = recv(connfd, req->originalBuffer + req->length, req->capacity - req->length, 0);
 
-			strcat(req->originalBuffer, recvBuffer);
-		} else if (currentReadNum < 0) {
-			perror("Error reading data from user.");
-			return NULL;
+		if (currentReadNum > 0) {
+			req->length += currentReadNum;
+			req->originalBuffer[req->length] = '\0';
+			parseRequestHead(req);
+		} else if (currentReadNum == 0) {  // client hung up before finishing
+			return IO_ERROR;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return IO_AGAIN;
+		} else if (errno != EINTR) {
+			logMessage(LOG_ERROR, "Error reading data from user: %s", strerror(errno));
+			return IO_ERROR;
 		}
-	} while (currentReadNum == MAXBUF);  // not done reading
+	}
 
-	return req->originalBuffer;
+	return IO_DONE;
 }
 
-char *parseRequest(request *req, const char *cacheDir) {
-	char *tmp = NULL, *savePtr = NULL, *finder = NULL;
-	req->postProcessBuffer = (char *)malloc(strlen(req->originalBuffer) + 1);
-
-	strcpy(req->postProcessBuffer, req->originalBuffer);
+static int spanIs(const request *req, httpSpan span, const char *str) {
+	return span.length == strlen(str) && strncasecmp(req->originalBuffer + span.offset, str, span.length) == 0;
+}
 
-	// grab the method stuff
-	req->method = strtok_r(req->postProcessBuffer, " ", &savePtr);
-	req->requestPath = strtok_r(NULL, " ", &savePtr);
-	req->protocol = strtok_r(NULL, "\n", &savePtr);
-	trimSpace(req->protocol);
+/**
+ * Finds a header of the parsed request by name, ignoring case.
+ * @return Its value, or NULL if the client didn't send it.
+ */
+const char *requestHeader(const request *req, const char *name) {
+	int i;
 
-	if (strcmp(req->method, "GET") != 0) {
-		free(req->postProcessBuffer);
-		return NULL;
+	for (i = 0; i < req->headerCount; i++) {
+		if (spanIs(req, req->headers[i].name, name))
+			return req->originalBuffer + req->headers[i].value.offset;
 	}
+	return NULL;
+}
 
-	tmp = strtok_r(NULL, " ", &savePtr);
-	if (tmp != NULL && strcmp(tmp, "Host:") == 0){  // host specification
-		tmp = strtok_r(NULL, "\n", &savePtr);  // grab the rest of the line
-
-		if (tmp != NULL) {
-			trimSpace(tmp);
-			finder = strchr(tmp, ':');
+static void appendSpan(request *req, httpSpan span, const char *after) {
+	memcpy(req->forwardBuffer + req->forwardLength, req->originalBuffer + span.offset, span.length);
+	req->forwardLength += span.length;
+	strcpy(req->forwardBuffer + req->forwardLength, after);
+	req->forwardLength += strlen(after);
+}
 
-			if (finder != NULL) {  // port number found
-				req->port = atoi(finder + 1);
-				finder[0] = '\0';
-			} else {
-				req->port = 80;
-			}
+/**
+ * The client's own conditions aren't passed on. What comes back is stored for everybody, so it has to be the whole
+ * object, and a full response answers a conditional request just as well.
+ */
+static int conditionalHeader(const request *req, httpSpan name) {
+	return spanIs(req, name, "If-None-Match") || spanIs(req, name, "If-Modified-Since") ||
+			spanIs(req, name, "If-Match") || spanIs(req, name, "If-Unmodified-Since") || spanIs(req, name, "If-Range");
+}
 
-			req->host = tmp;
-		} else {
-			perror("Error parsing request: invalid host");
-			free(req->postProcessBuffer);
-			free(req->originalBuffer);
-			return NULL;
-		}
+/**
+ * Puts the client's head back together for the destination from the parsed offsets, swapping whatever it said about
+ * the connection for keep-alive, since the destination connection outlives this client and goes back to the pool.
+ */
+static int buildForwardRequest(request *req) {
+	const char *keepAlive = "Connection: keep-alive\r\n\r\n";
+	size_t size = req->methodSpan.length + req->targetSpan.length + req->versionSpan.length + 4 + strlen(keepAlive) + 1;
+	int i;
+
+	for (i = 0; i < req->headerCount; i++)
+		size += req->headers[i].name.length + req->headers[i].value.length + 4;
+	if ((req->forwardBuffer = arenaAlloc(&req->arena, size)) == NULL)
+		return -1;
+	req->forwardLength = 0;
+
+	appendSpan(req, req->methodSpan, " ");
+	appendSpan(req, req->targetSpan, " ");
+	appendSpan(req, req->versionSpan, "\r\n");
+	for (i = 0; i < req->headerCount; i++) {
+		if (spanIs(req, req->headers[i].name, "Connection") || spanIs(req, req->headers[i].name, "Proxy-Connection") ||
+				spanIs(req, req->headers[i].name, "Keep-Alive") || conditionalHeader(req, req->headers[i].name))
+			continue;
+		appendSpan(req, req->headers[i].name, ": ");
+		appendSpan(req, req->headers[i].value, "\r\n");
 	}
 
-	// MD5 hash requestPath
-	if ((req->requestHash = malloc(HEX_BYTES + 1)) == NULL) {
-		perror("Failed allocating requestHash in parseResponse");
-		free(req->originalBuffer);
-		free(req->postProcessBuffer);
-		return NULL;
+	strcpy(req->forwardBuffer + req->forwardLength, keepAlive);
+	req->forwardLength += strlen(keepAlive);
+	return 0;
+}
+
+// host[:port] into req->host and req->port
+static int parseHost(request *req, const char *host, size_t length) {
+	const char *colon = memchr(host, ':', length);
+
+	req->port = 80;
+	if (colon != NULL) {
+		req->port = atoi(colon + 1);
+		length = colon - host;
 	}
-	md5Str(req->requestPath, req->requestHash);
+	if (length == 0 || length >= MAXHOST || req->port <= 0 || req->port > 65535)
+		return -1;
+
+	memcpy(req->host, host, length);
+	req->host[length] = '\0';
+	return 0;
+}
+
+// what one piece of the cache key is separated from the next by, so "a b" + "c" and "a" + "b c" hash apart
+static const char keySeparator = '\0';
 
-	return req->postProcessBuffer;
+/**
+ * Hashes method, host, port and path into the request's key, so an absolute target and an origin-form one with a Host
+ * header share an object. The pieces are fed to the hash where they lie, nothing is allocated. The binary digest keys
+ * the cache index, the hex form names the file.
+ */
+static void cacheKey(request *req) {
+	const char *path = req->requestPath;
+	char portStr[8];
+	int portLength;
+	keyHasher hasher;
+
+	if (strncasecmp(path, "http://", 7) == 0)
+		path += 7 + strcspn(path + 7, "/?#");
+	portLength = snprintf(portStr, sizeof(portStr), "%d", req->port);
+
+	keyHashInit(&hasher);
+	keyHashUpdate(&hasher, req->method, strlen(req->method));
+	keyHashUpdate(&hasher, &keySeparator, 1);
+	keyHashUpdate(&hasher, req->host, strlen(req->host));
+	keyHashUpdate(&hasher, &keySeparator, 1);
+	keyHashUpdate(&hasher, portStr, portLength);
+	keyHashUpdate(&hasher, &keySeparator, 1);
+	keyHashUpdate(&hasher, path, strlen(path));
+	keyHashFinal(&hasher, req->requestKey);
+	digestStr(req->requestKey, req->requestHash);
 }
 
-FILE * forwardRequest(request *req, struct cache *cache) {
-	int sock, bytesCopied = 0, bytesSent, totalReceived = 0, bytesReceived;
-	long contentLength = 0, headerSize = 0;
-	char socketBuffer[MAXBUF], fileName[PATH_MAX], *lengthHeaderLocation, *eol, tmp, *endOfHeader;
-	const char *headerStr = "Content-Length: ";
-	FILE *returnFile = NULL;
-	struct sockaddr_in *server;
-	struct addrinfo *infoResults;
-
-	// check the hostname file
-	infoResults = hostnameLookup(req->host, cache);
-	if (infoResults == NULL) {
-		fprintf(stderr, "Could not find hostname of specified host: %s\n", req->host);
-		return NULL;
+/**
+ * Makes sense of the head readRequest() parsed. The request line's parts and the header values are terminated in
+ * place, the offsets are what the forwarded request is rebuilt from, so nothing is copied but the host name.
+ * @return 0, or -1 if the request is malformed or not something the proxy handles.
+ */
+int parseRequest(request *req) {
+	const char *value, *target;
+	size_t hostLength;
+	int i;
+
+	if (req->parseState != PARSE_DONE)
+		return -1;
+
+	req->method = req->originalBuffer + req->methodSpan.offset;
+	req->requestPath = req->originalBuffer + req->targetSpan.offset;
+	req->protocol = req->originalBuffer + req->versionSpan.offset;
+	req->method[req->methodSpan.length] = '\0';
+	req->requestPath[req->targetSpan.length] = '\0';
+	req->protocol[req->versionSpan.length] = '\0';
+	for (i = 0; i < req->headerCount; i++)
+		req->originalBuffer[req->headers[i].value.offset + req->headers[i].value.length] = '\0';
+
+	if (strcmp(req->method, "GET") != 0)
+		return -1;
+
+	// the Host header wherever it is, or else the authority of an absolute target
+	if ((value = requestHeader(req, "Host")) != NULL) {
+		if (parseHost(req, value, strlen(value)) < 0)
+			return -1;
+	} else if (strncasecmp(req->requestPath, "http://", 7) == 0) {
+		target = req->requestPath + 7;
+		hostLength = strcspn(target, "/?#");
+		if (parseHost(req, target, hostLength) < 0)
+			return -1;
+	} else {
+		return -1;
 	}
 
-	char *blackListName = "/blacklist";
-	char *bFN = malloc(strlen(cache->cacheDirectory) + strlen(blackListName) + 1);
-	strcpy(bFN, cache->cacheDirectory);
-	strcat(bFN, blackListName);
-	FILE *blacklist = fopen(bFN, "r");
-	free(bFN);
-
-	int found = 0;
-	if (blacklist != NULL) {
-		char lineBuf[MAXLINE];
-		char ip[INET6_ADDRSTRLEN];
-		while (fgets(lineBuf, MAXLINE, blacklist) && !found) {
-			trimSpace(lineBuf);
-			if (isdigit(lineBuf[0])) {
-				inet_ntop(infoResults->ai_family, &((struct sockaddr_in *)infoResults->ai_addr)->sin_addr,
-						ip, INET6_ADDRSTRLEN);
-				found = strcmp(lineBuf, ip);
-			} else {
-				found = strcmp(lineBuf, req->host) == 0;
-			}
-		}
-		fclose(blacklist);
+	// what the client said about the connection decides whether it stays open afterwards
+	req->keepAlive = strcmp(req->protocol, "HTTP/1.1") == 0;
+	for (i = 0; i < req->headerCount; i++) {
+		if (!spanIs(req, req->headers[i].name, "Connection") && !spanIs(req, req->headers[i].name, "Proxy-Connection"))
+			continue;
+		value = req->originalBuffer + req->headers[i].value.offset;
+		if (strcasestr(value, "close") != NULL)
+			req->keepAlive = 0;
+		else if (strcasestr(value, "keep-alive") != NULL)
+			req->keepAlive = 1;
 	}
 
-	if (found == 1) {
-		freeaddrinfo(infoResults);
-		return (FILE *)1;
+	cacheKey(req);
+	return buildForwardRequest(req);
+}
+
+/**
+ * Copies a parsed request, head and forwarded form, so the same object can be fetched again on a connection of its own.
+ * Whatever was pipelined behind it stays with the original.
+ * @return 0, or -1 if the buffers couldn't be allocated.
+ */
+int cloneRequest(request *copy, const request *req) {
+	*copy = *req;
+	bzero(&copy->arena, sizeof(arena));
+	copy->originalBuffer = malloc(req->consumed + 1);
+	copy->forwardBuffer = arenaAlloc(&copy->arena, req->forwardLength + 1);
+	if (copy->originalBuffer == NULL || copy->forwardBuffer == NULL) {
+		perror("Failed to copy request");
+		freeRequest(copy);
+		return -1;
 	}
 
+	memcpy(copy->originalBuffer, req->originalBuffer, req->consumed);
+	copy->originalBuffer[req->consumed] = '\0';
+	copy->length = copy->capacity = req->consumed;
+	memcpy(copy->forwardBuffer, req->forwardBuffer, req->forwardLength + 1);
+
+	// the parsed pieces point into the buffer they were cut from
+	copy->method = copy->originalBuffer + (req->method - req->originalBuffer);
+	copy->requestPath = copy->originalBuffer + (req->requestPath - req->originalBuffer);
+	copy->protocol = copy->originalBuffer + (req->protocol - req->originalBuffer);
+	return 0;
+}
 
-	// open returnFile
-	bzero(fileName, PATH_MAX);
-	snprintf(fileName, PATH_MAX, "%s/%s", cache->cacheDirectory, req->requestHash);
+/**
+ * Turns the forwarded request into a conditional one for an expired copy, so the destination can answer 304 instead of
+ * sending the object again.
+ * @return 0, or -1 if the request couldn't be grown.
+ */
+int revalidateRequest(request *req, const cacheValidators *validators) {
+	size_t size = req->forwardLength + 2 * VALIDATOR_BYTES + 64;
+	char *grown;
+
+	if ((grown = arenaGrow(&req->arena, req->forwardBuffer, req->forwardLength + 1, size)) == NULL)
+		return -1;
+	req->forwardBuffer = grown;
+
+	// in front of the empty line that ends the head
+	req->forwardLength -= 2;
+	if (validators->etag[0] != '\0')
+		req->forwardLength += sprintf(req->forwardBuffer + req->forwardLength, "If-None-Match: %s\r\n",
+				validators->etag);
+	if (validators->lastModified[0] != '\0')
+		req->forwardLength += sprintf(req->forwardBuffer + req->forwardLength, "If-Modified-Since: %s\r\n",
+				validators->lastModified);
+	req->forwardLength += sprintf(req->forwardBuffer + req->forwardLength, "\r\n");
+	return 0;
+}
 
-	if ((returnFile = fopen(fileName, "w")) == NULL) {
-		perror("failed opening new cache file");
-		freeaddrinfo(infoResults);
-		return NULL;
+/**
+ * Checks the resolved destination's address against the blacklist and either reuses an idle connection to it from the
+ * pool or starts a non-blocking connect. The response will be written to res->cacheFd, the file joinFetch() handed the
+ * leader.
+ * @param pool Where to look for an idle connection, NULL to always connect afresh.
+ * @return IO_DONE if already connected, IO_AGAIN if the connect is in progress, IO_FORBIDDEN or IO_ERROR otherwise.
+ */
+int forwardRequest(request *req, response *res, const struct blacklist *blacklist, struct upstreamPool *pool) {
+	int sock;
+	struct sockaddr_in server;
+
+	bzero(&server, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(req->port);
+	server.sin_addr = res->destination;
+
+	if (blacklistedAddress(blacklist, server.sin_addr))
+		return IO_FORBIDDEN;
+
+	res->available = 0;
+	freeFramer(&res->framer);
+
+	// skip the handshake if a previous request left a connection to this destination open
+	if (pool != NULL && (res->serverfd = checkoutConnection(pool, req->host, req->port)) >= 0) {
+		res->reused = 1;
+		return IO_DONE;
 	}
+	res->reused = 0;
 
 	// open socket
-	if ((sock = socket(infoResults->ai_family, SOCK_STREAM, 0)) < 0) {
+	if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
 		perror("Couldn't open socket to destination");
-		fclose(returnFile);
-		freeaddrinfo(infoResults);
-		return NULL;
+		return IO_ERROR;
 	}
-
-	// set socket args
-	server = (struct sockaddr_in *) infoResults->ai_addr;
-	server->sin_port = htons(req->port);  // pick random t
-
-	// connect socket
-	if (connect(sock, (struct sockaddr *)server, infoResults->ai_addrlen) < 0) {
-		fprintf(stderr, "Failed to connect to destination %s: %s\n", req->requestPath, strerror(errno));
-		fclose(returnFile);
-		freeaddrinfo(infoResults);
-		close(sock);
-		return NULL;
+	res->serverfd = sock;
+
+	// connect socket, finishing in the background if it can't complete right away
+	if (connect(sock, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		if (errno == EINPROGRESS)
+			return IO_AGAIN;
+		logMessage(LOG_WARN, "Failed to connect to destination %s: %s", req->requestPath, strerror(errno));
+		return IO_ERROR;
 	}
 
-	// forward request
-	do {
-		bzero(socketBuffer, MAXBUF);
-		memcpy(socketBuffer, req->originalBuffer + bytesCopied, strlen(req->originalBuffer + bytesCopied));
+	return IO_DONE;
+}
+
+/**
+ * Pushes the client's request to the destination, resuming where the last call left off.
+ */
+int sendRequest(request *req, response *res) {
+	int connectError = 0;
+	socklen_t errorLength = sizeof(connectError);
+	ssize_t bytesSent;
+
+	// find out how the non-blocking connect went before writing anything
+	if (res->bytesForwarded == 0) {
+		if (getsockopt(res->serverfd, SOL_SOCKET, SO_ERROR, &connectError, &errorLength) < 0 || connectError != 0) {
+			logMessage(LOG_WARN, "Failed to connect to destination %s: %s", req->requestPath, strerror(connectError));
+			return IO_ERROR;
+		}
+	}
 
-		bytesSent = send(sock, socketBuffer, strlen(socketBuffer), 0);
-		if (bytesSent < 0) {
-			perror("Error sending data");
-		} else {
-			bytesCopied += bytesSent;  // Should this be bytesCopied += MAXBUF??
+	while (res->bytesForwarded < req->forwardLength) {
+		bytesSent = send(res->serverfd, req->forwardBuffer + res->bytesForwarded,
+				req->forwardLength - res->bytesForwarded, 0);
+
+		if (bytesSent > 0) {
+			res->bytesForwarded += bytesSent;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) {
+			return IO_AGAIN;
+		} else if (res->reused && (errno == EPIPE || errno == ECONNRESET)) {
+			return IO_RETRY;  // the destination closed the pooled connection while we were picking it up
+		} else if (errno != EINTR) {
+			logMessage(LOG_ERROR, "Error sending data: %s", strerror(errno));
+			return IO_ERROR;
 		}
-	} while (bytesSent == MAXBUF);  // TODO: check this
-
-	// receive response
-	do {
-		bzero(socketBuffer, MAXBUF);
-		bytesReceived = recv(sock, socketBuffer, MAXBUF, 0);
-
-		if (endOfHeader == NULL && (endOfHeader = strstr(socketBuffer, "\r\n\r\n")) != NULL) {
-			tmp = endOfHeader[4];
-			endOfHeader[4] = '\0';
-			headerSize = strlen(socketBuffer);
-			endOfHeader[4] = tmp;
+	}
+
+	return IO_DONE;
+}
+
+// appends len bytes of buf to the cache file, the write side of a fetch
+static int writeCacheFile(response *res, const char *buf, size_t len) {
+	ssize_t written;
+
+	while (len > 0) {
+		if ((written = write(res->cacheFd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logMessage(LOG_ERROR, "Error writing cache file: %s", strerror(errno));
+			return IO_ERROR;
 		}
-		// TODO: Deal with HTTP/1.1 transfer encoding chunked.
-		if ((lengthHeaderLocation = strstr(socketBuffer, headerStr)) != NULL) {
-			if ((eol = strstr(lengthHeaderLocation + strlen(headerStr), "\r\n")) != NULL) {
-				eol[0] = '\0';  // finish line
-				contentLength = atol(lengthHeaderLocation + strlen(headerStr));
-				eol[0] = '\r';
+		buf += written;
+		len -= written;
+	}
+	return IO_DONE;
+}
+
+/**
+ * Moves up to len bytes of body from the destination socket into the cache file through a pipe, so the data never
+ * gets copied into user space.
+ * @return Bytes moved, 0 at end of stream, or -1 with errno set.
+ */
+static ssize_t spliceToCacheFile(response *res, size_t len) {
+	ssize_t moved, written, total;
+
+	if (res->pipefds[0] < 0 && pipe2(res->pipefds, O_NONBLOCK) < 0)
+		return -1;
+
+	if ((moved = splice(res->serverfd, NULL, res->pipefds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) <= 0)
+		return moved;
+
+	// drain the pipe into the file, regular files never report EAGAIN
+	for (total = 0; total < moved; total += written) {
+		if ((written = splice(res->pipefds[0], NULL, res->cacheFd, NULL, moved - total, SPLICE_F_MOVE)) < 0) {
+			if (errno == EINTR) {
+				written = 0;
+				continue;
 			}
+			return -1;
 		}
+	}
+	return moved;
+}
 
-		if (bytesReceived < 0) {
-			perror("Error reading response");
-		} else {
-			totalReceived += bytesReceived;
-			fwrite(socketBuffer, sizeof(char), bytesReceived, returnFile);
-		}
+// statuses a shared cache may keep without being told it can
+static int storableStatus(int status) {
+	switch (status) {
+		case 200: case 203: case 204: case 300: case 301: case 404: case 405: case 410: case 414: case 501:
+			return 1;
+		default:
+			return 0;
+	}
+}
 
-	} while (bytesReceived == MAXBUF || totalReceived < (contentLength + headerSize));
-	close(sock);
-	fclose(returnFile);
-	returnFile = fopen(fileName, "r");
+/**
+ * A copy that's stale from the start, can't be handed out stale and can't be revalidated would never be served again.
+ * What the response leaves unsaid is up to the cache's defaults, the way it will be once the copy is stored.
+ */
+static int servable(const responseFramer *framer, const struct cache *cache) {
+	long maxAge = framer->maxAge >= 0 ? framer->maxAge : cache->timeout;
+	long staleGrace = framer->staleGrace >= 0 ? framer->staleGrace : cache->staleGrace;
 
-	freeaddrinfo(infoResults);
+	return maxAge > 0 || staleGrace > 0 || framer->etag[0] != '\0' || framer->lastModified[0] != '\0';
+}
+
+/**
+ * The response head is in, tell the fetch what it says about caching the object. Whoever receives a response leads
+ * a fetch, a background refresh included, so there always is one. A 304 to a revalidation copies the expired object
+ * into the cache file in place of the response, the 304 itself goes nowhere.
+ * @return 1 if the expired copy was revalidated, 0 if the response goes on as it is, -1 on error.
+ */
+static int headArrived(response *res) {
+	responseFramer *framer = &res->framer;
+	inflightFetch *fetch = res->fetch;
+	struct stat staleStat;
+	off_t copied = 0;
+	ssize_t moved;
+
+	// the client can tell where the response ends unless it runs until the connection closes
+	res->framed = framer->framing != FRAME_CLOSE;
+	fetch->framed = res->framed;
+	fetch->maxAge = framer->maxAge;
+	fetch->staleGrace = framer->staleGrace;
+	fetch->storable = !framer->noStore && storableStatus(framer->status) && servable(framer, fetch->shard->cache);
+	strcpy(fetch->validators.etag, framer->etag);
+	strcpy(fetch->validators.lastModified, framer->lastModified);
+	if (framer->status != 304 || fetch->staleFd < 0)
+		return 0;
+
+	// whatever the 304 didn't say about the object still holds
+	if (fetch->validators.etag[0] == '\0')
+		strcpy(fetch->validators.etag, fetch->staleValidators.etag);
+	if (fetch->validators.lastModified[0] == '\0')
+		strcpy(fetch->validators.lastModified, fetch->staleValidators.lastModified);
+	if (fetch->maxAge < 0)
+		fetch->maxAge = fetch->staleLifetime;
+	if (fetch->staleGrace < 0)
+		fetch->staleGrace = fetch->staleWindow;
+	fetch->storable = !framer->noStore;
+
+	if (fstat(fetch->staleFd, &staleStat) < 0)
+		return -1;
+	while (copied < staleStat.st_size) {
+		if ((moved = sendfile(res->cacheFd, fetch->staleFd, &copied, staleStat.st_size - copied)) <= 0) {
+			if (moved < 0 && errno == EINTR)
+				continue;
+			logMessage(LOG_ERROR, "Failed to copy revalidated object: %s", strerror(errno));
+			return -1;
+		}
+	}
 
-	addToCache(req->requestHash, cache);
-	printf("Added %s (%s) to cache\n", req->requestPath, req->requestHash);
-	return returnFile;
+	res->framed = fetch->framed = fetch->staleFramed;
+	res->totalReceived = copied;
+	return 1;
 }
 
-void sendResponse(int connfd, FILE *cacheFile) {
-	int bytesRead, bytesSent;
+/**
+ * Moves the next piece of the destination's response into the cache file. The head and any chunk size lines are read
+ * normally so the framer can follow them, runs of body whose length is already known are spliced straight to the
+ * file. Each piece becomes available to sendResponse() as soon as it lands, and once the framer has seen the end of the
+ * response it is added to the cache.
+ * @return IO_PARTIAL after each piece, IO_DONE at the end of the response, IO_AGAIN or IO_ERROR otherwise.
+ */
+int receiveResponse(request *req, response *res) {
+	responseFramer *framer = &res->framer;
+	ssize_t bytesReceived, used;
+	size_t spliceable;
+	int inHead, revalidated = 0;
 	char socketBuffer[MAXBUF];
 
-	do {
-		bzero(socketBuffer, MAXBUF);
-		bytesRead = fread(socketBuffer, sizeof(char), MAXBUF, cacheFile);  // FIXME: conversion issue?
-		bytesSent = send(connfd, socketBuffer, bytesRead, 0);
+	while (!framer->done) {
+		if ((spliceable = framerSpliceable(framer)) > 0)
+			bytesReceived = spliceToCacheFile(res, spliceable);
+		else
+			bytesReceived = recv(res->serverfd, socketBuffer, MAXBUF, 0);
 
-		if (bytesSent < 0) {
-			perror("Error sending data back to client");
-			bytesRead = MAXBUF - 1;  // break loop
+		if (bytesReceived < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return IO_AGAIN;
+			if (errno == EINTR)
+				continue;
+			if (res->reused && res->totalReceived == 0 && errno == ECONNRESET)
+				return IO_RETRY;
+			logMessage(LOG_ERROR, "Error reading response: %s", strerror(errno));
+			return IO_ERROR;
+		} else if (bytesReceived == 0) {  // destination closed the connection
+			if (res->reused && res->totalReceived == 0)
+				return IO_RETRY;  // pooled connection had gone stale, nothing lost yet
+			if (framerClosed(framer) < 0) {
+				logMessage(LOG_WARN, "Destination closed before the end of %s", req->requestPath);
+				return IO_ERROR;
+			}
+			framer->persistent = 0;
+			break;
 		}
-	} while (bytesRead == MAXBUF);
-}
 
-// FIXME: this function messed up
-struct addrinfo * hostnameLookup(char *hostname, struct cache *cache) {
-	if (cache == NULL || hostname == NULL)
-		return NULL;
-
-	char *savePoint = NULL, *domain = "\0", *ip;
-	char lineBuf[MAXLINE], translateIP[INET6_ADDRSTRLEN];
-	FILE *dnsFile = NULL;
-	int lookupError = 1;  // all error codes are < 0, and since 0 is "success" we need something greater than 0
-	struct addrinfo hints, *infoResults = NULL;
-
-	// hints setup
-	bzero(&hints, sizeof(struct addrinfo));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-
-	pthread_mutex_lock(cache->hostnameMutex);
-	// TODO: Implement blacklist check
-	if ((dnsFile = fopen(cache->dnsFile, "r")) != NULL) {  // found cache file
-		while (strcmp(domain, hostname) != 0 && fgets(lineBuf, MAXLINE, dnsFile)) {
-			domain = strtok_r(lineBuf, ",", &savePoint);
-			ip = strtok_r(NULL, "\n", &savePoint);
+		if (spliceable > 0) {
+			framerMoved(framer, bytesReceived);
+		} else {
+			used = 0;
+			if ((inHead = !framer->headDone) && (used = framerHead(framer, &req->arena, socketBuffer, bytesReceived)) < 0) {
+				logMessage(LOG_WARN, "Malformed response head for %s", req->requestPath);
+				return IO_ERROR;
+			}
+			if (framer->headDone && used < bytesReceived &&
+					framerBody(framer, socketBuffer + used, bytesReceived - used) < 0) {
+				logMessage(LOG_WARN, "Malformed chunked body for %s", req->requestPath);
+				return IO_ERROR;
+			}
+			if (!framer->headDone)
+				continue;  // the framer holds on to the head until it's complete, interim 1xx heads go nowhere
+
+			// the final head goes in as the framer kept it, what came before it in this piece was interim
+			if (inHead && (revalidated = headArrived(res)) < 0)
+				return IO_ERROR;
+			if (inHead && !revalidated && writeCacheFile(res, framer->head, framer->headLength) != IO_DONE)
+				return IO_ERROR;
+			if (!revalidated && writeCacheFile(res, socketBuffer + used, bytesReceived - used) != IO_DONE)
+				return IO_ERROR;
+			bytesReceived += inHead ? (ssize_t)framer->headLength - used : 0;
 		}
-		fclose(dnsFile);
-		pthread_mutex_unlock(cache->hostnameMutex);
+		if (!revalidated)
+			res->totalReceived += bytesReceived;
+		res->available = res->totalReceived;
+		publishFetch(res->fetch, res->available);
+
+		if (!framer->done)
+			return IO_PARTIAL;
+	}
 
-		// found IP address in cache file
-		if (domain != NULL && ip != NULL && strcmp(domain, hostname) == 0 && strcmp(ip, "UNKNOWN") != 0) {
-			hints.ai_flags |= AI_NUMERICHOST;  // found in cache, build socket
+	// the caller hands the connection back to the pool if it can be reused, or closes it
+	res->keepAlive = framer->persistent;
+
+	if (framer->status == 304 && res->fetch->staleFd >= 0)
+		logMessage(LOG_INFO, "Revalidated %s (%s)", req->requestPath, req->requestHash);
+	else if (!res->fetch->storable)
+		logMessage(LOG_INFO, "Passed on %s (%s) without caching it", req->requestPath, req->requestHash);
+	else
+		logMessage(LOG_INFO, "Added %s (%s) to cache", req->requestPath, req->requestHash);
+	finishFetch(res->fetch, FETCH_DONE);
+	res->leading = 0;
+	return IO_DONE;
+}
 
-			lookupError = getaddrinfo(ip, NULL, &hints, &infoResults);
-		} else if (domain != NULL && strcmp(domain, hostname) != 0) {
-			// not found in cache. Will have to add it now.
-			lookupError = getaddrinfo(hostname, NULL, &hints, &infoResults);
+/**
+ * Sends the cache file to the client from where the previous call stopped, up to as much of it as is available.
+ * sendfile() moves it from the page cache to the socket without a trip through user space.
+ * @return IO_DONE once the client has caught up with the file, IO_AGAIN if its socket is full, IO_ERROR otherwise.
+ */
+int sendResponse(int connfd, response *res) {
+	ssize_t bytesSent;
+	struct stat fileInfo;
+
+	if (res->memory != NULL) {  // in-memory hit, plain send straight out of the slab chunk
+		while (res->bytesSent < (off_t)res->memory->length) {
+			bytesSent = send(connfd, res->memory->data + res->bytesSent, res->memory->length - res->bytesSent, 0);
+
+			if (bytesSent > 0) {
+				res->bytesSent += bytesSent;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return IO_AGAIN;
+			} else if (errno != EINTR) {
+				logMessage(LOG_ERROR, "Error sending data back to client: %s", strerror(errno));
+				return IO_ERROR;
+			}
 		}
+		return IO_DONE;
+	}
 
-	} else {  // couldn't open the cache file, just try resolving
-		pthread_mutex_unlock(cache->hostnameMutex);
-		lookupError = getaddrinfo(hostname, NULL, &hints, &infoResults);
+	if (res->available < 0) {  // a complete file from the cache
+		if (fstat(res->cacheFd, &fileInfo) < 0) {
+			logMessage(LOG_ERROR, "Error reading cache file: %s", strerror(errno));
+			return IO_ERROR;
+		}
+		res->available = fileInfo.st_size;
 	}
 
-	// write to cache if we didn't grab the IP from cache
-	pthread_mutex_lock(cache->hostnameMutex);
-	dnsFile = fopen(cache->dnsFile, "a");
-
-	if (dnsFile == NULL)
-		perror("Failed to open DNS cache file for writing");
-	else if (lookupError < 0 && strcmp(domain, hostname) != 0)  // failed lookup, didn't find it in the file
-		fprintf(dnsFile, "%s,UNKNOWN\n", hostname);
-	else if (lookupError == 0 && !(AI_NUMERICHOST & hints.ai_flags)){  // we have not seen this IP before
-		inet_ntop(infoResults->ai_family, &((struct sockaddr_in *)infoResults->ai_addr)->sin_addr,
-				translateIP, INET6_ADDRSTRLEN);
-		fprintf(dnsFile, "%s,%s\n", hostname, translateIP);
+	while (res->bytesSent < res->available) {
+		bytesSent = sendfile(connfd, res->cacheFd, &res->bytesSent, res->available - res->bytesSent);
+
+		if (bytesSent == 0) {  // file shrank underneath us, nothing more to send
+			return IO_DONE;
+		} else if (bytesSent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return IO_AGAIN;
+			if (errno != EINTR) {
+				logMessage(LOG_ERROR, "Error sending data back to client: %s", strerror(errno));
+				return IO_ERROR;
+			}
+		}
 	}
-	fclose(dnsFile);
-	pthread_mutex_unlock(cache->hostnameMutex);
+	return IO_DONE;
+}
 
-	// final return system
-	return infoResults;
+/**
+ * Gets req ready for the next request on the same connection. Whatever the client pipelined behind the current one is
+ * kept at the start of the buffer.
+ */
+void nextRequest(request *req) {
+	char *buffer = req->originalBuffer;
+	size_t capacity = req->capacity, leftover = req->length - req->consumed;
+	arena kept = req->arena;
+
+	memmove(buffer, buffer + req->consumed, leftover);
+	buffer[leftover] = '\0';
+	arenaReset(&kept);
+	bzero(req, sizeof(request));
+
+	req->originalBuffer = buffer;
+	req->capacity = capacity;
+	req->length = leftover;
+	req->arena = kept;
 }
 
+void freeRequest(request *req) {
+	free(req->originalBuffer);
+	arenaFree(&req->arena);
+	bzero(req, sizeof(request));
+}
+
+void initResponse(response *res) {
+	bzero(res, sizeof(response));
+	res->serverfd = -1;
+	res->cacheFd = -1;
+	res->pipefds[0] = res->pipefds[1] = -1;
+	res->available = -1;
+	initFramer(&res->framer);
+}
+
+void freeResponse(response *res) {
+	if (res->fetch != NULL) {
+		if (res->leading)  // gave up half way, let the followers know
+			finishFetch(res->fetch, FETCH_FAILED);
+		leaveFetch(res->fetch, &res->waiter);
+	}
+	if (res->cacheFd >= 0)
+		close(res->cacheFd);
+	if (res->memory != NULL)
+		releaseMemoryObject(res->memory);
+	if (res->serverfd >= 0)
+		close(res->serverfd);
+	if (res->pipefds[0] >= 0) {
+		close(res->pipefds[0]);
+		close(res->pipefds[1]);
+	}
+	freeFramer(&res->framer);
+	initResponse(res);
+}
 
 /**
  * Removes trailing spaces from a string.
@@ -7,36 +7,101 @@
 
 #include "macro.h"
 #include "cache.h"
-#include <semaphore.h>
+#include "pool.h"
+#include "blacklist.h"
+#include "framing.h"
+#include "arena.h"
+#include <sys/types.h>
+#include <stdint.h>
+#include <linux/limits.h>
 #include <time.h>
+#include <netinet/in.h>
+
+// where something is in the request buffer, offsets stay valid when the buffer is grown
+typedef struct {
+	size_t offset;
+	size_t length;
+} httpSpan;
+
+typedef struct {
+	httpSpan name;
+	httpSpan value;
+} httpHeader;
 
 typedef struct {
 	char *method;  // should always be GET
 	char *requestPath;
 	char *protocol;
-	char *host;
+	char host[MAXHOST];
 	char *originalBuffer;
-	char *postProcessBuffer;
-	char *requestHash;
+	char requestHash[HEX_BYTES + 1];  // hex form of requestKey
+	uint8_t requestKey[DIGEST_BYTES];
 	int port;
+	size_t length;  // bytes of originalBuffer filled so far
+	size_t capacity;  // bytes allocated for originalBuffer
+	size_t consumed;  // bytes of originalBuffer this request takes up, anything after is the next pipelined one
+	int keepAlive;  // the client wants the connection kept open for another request
+	char *forwardBuffer;  // the header block as sent to the destination, from arena
+	size_t forwardLength;
+
+	// incremental parser state, so a head split over many reads is only scanned once
+	int parseState;
+	size_t scanned;  // bytes of originalBuffer looked at
+	size_t lineStart;  // where the line being parsed starts
+	httpSpan methodSpan;
+	httpSpan targetSpan;
+	httpSpan versionSpan;
+	httpHeader headers[MAX_HEADERS];
+	int headerCount;
+
+	arena arena;  // the forwarded request and the response head, rewound by nextRequest()
 } request;
 
+// progress of a single upstream fetch / client reply
 typedef struct {
-	int *connfd;
-	int *numThreads;
-	pthread_mutex_t *threadMutex;
-	struct cache *cache;
-} threadParams;
+	int cacheFd;  // written while fetching and read while replying, at the same time when streaming a miss
+	memoryObject *memory;  // set instead of cacheFd for a hit in the in-memory tier
+	inflightFetch *fetch;  // the miss this reply is part of, if any
+	fetchWaiter waiter;  // how a follower hears about progress on fetch
+	int leading;  // this connection fetches for everyone and still owes them a finishFetch()
+	int reused;  // serverfd came out of the connection pool
+	int keepAlive;  // serverfd can go back to the pool once the response is read
+	int framed;  // the client can tell where the response ends without us closing the connection
+	struct in_addr destination;  // where req->host resolved to
+	int serverfd;
+	int pipefds[2];  // splices the body from serverfd into cacheFd
+	size_t bytesForwarded;  // bytes of the request sent upstream
+	long totalReceived;
+	responseFramer framer;  // where the response from the destination ends
+	off_t bytesSent;  // bytes of the cache file sent to the client
+	off_t available;  // bytes of the cache file ready to send, -1 until a cached file has been measured
+} response;
+
+int readRequest(int connfd, request *req);
+
+int parseRequest(request *req);
+
+const char *requestHeader(const request *req, const char *name);
+
+int cloneRequest(request *copy, const request *req);
+
+int revalidateRequest(request *req, const cacheValidators *validators);
+
+int forwardRequest(request *req, response *res, const struct blacklist *blacklist, struct upstreamPool *pool);
+
+int sendRequest(request *req, response *res);
+
+int receiveResponse(request *req, response *res);
 
-char * readRequest(int connfd, request *req);
+int sendResponse(int connfd, response *res);
 
-char *parseRequest(request *req, const char *cacheDir);
+void nextRequest(request *req);
 
-FILE * forwardRequest(request *req, struct cache *cache);
+void freeRequest(request *req);
 
-void sendResponse(int connfd, FILE *cacheFile);
+void initResponse(response *res);
 
-struct addrinfo * hostnameLookup(char *hostname, struct cache *cache);
+void freeResponse(response *res);
 
 void trimSpace(char *s);
 
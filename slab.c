@@ -0,0 +1,87 @@
+//
+// Created by jmalcy on 11/26/20.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "slab.h"
+
+int slabInit(struct slabAllocator *allocator, size_t budget) {
+	bzero(allocator, sizeof(struct slabAllocator));
+	allocator->budget = budget;
+
+	if (pthread_mutex_init(&allocator->mutex, NULL) != 0) {
+		perror("Failed to initialize slab allocator");
+		return -1;
+	}
+	return 0;
+}
+
+// smallest class that fits size bytes, or -1 if it's too big for any of them
+int slabClass(size_t size) {
+	int sizeClass = 0;
+
+	while (sizeClass < SLAB_CLASSES && slabClassSize(sizeClass) < size)
+		sizeClass++;
+	return sizeClass < SLAB_CLASSES ? sizeClass : -1;
+}
+
+size_t slabClassSize(int sizeClass) {
+	return (size_t)SLAB_MIN_CHUNK << sizeClass;
+}
+
+/**
+ * Hands out a chunk of the given class, carving a new slab if its free list is empty and the budget allows.
+ * @return The chunk, or NULL if the class is exhausted and the budget is spent. The caller should evict and retry.
+ */
+void *slabAlloc(struct slabAllocator *allocator, int sizeClass) {
+	void *chunk, *slab, **grown;
+	size_t chunkSize = slabClassSize(sizeClass), offset;
+
+	pthread_mutex_lock(&allocator->mutex);
+
+	if (allocator->freeLists[sizeClass] == NULL && allocator->allocated + SLAB_BYTES <= allocator->budget) {
+		if ((slab = malloc(SLAB_BYTES)) != NULL &&
+				(grown = realloc(allocator->slabs, sizeof(void *) * (allocator->slabCount + 1))) != NULL) {
+			allocator->slabs = grown;
+			allocator->slabs[allocator->slabCount++] = slab;
+			allocator->allocated += SLAB_BYTES;
+
+			// thread the new slab's chunks onto the free list
+			for (offset = 0; offset + chunkSize <= SLAB_BYTES; offset += chunkSize) {
+				chunk = (char *)slab + offset;
+				*(void **)chunk = allocator->freeLists[sizeClass];
+				allocator->freeLists[sizeClass] = chunk;
+			}
+		} else {
+			free(slab);
+		}
+	}
+
+	if ((chunk = allocator->freeLists[sizeClass]) != NULL) {
+		allocator->freeLists[sizeClass] = *(void **)chunk;
+		allocator->inUse += chunkSize;
+	}
+
+	pthread_mutex_unlock(&allocator->mutex);
+	return chunk;
+}
+
+void slabFree(struct slabAllocator *allocator, void *chunk, int sizeClass) {
+	pthread_mutex_lock(&allocator->mutex);
+	*(void **)chunk = allocator->freeLists[sizeClass];
+	allocator->freeLists[sizeClass] = chunk;
+	allocator->inUse -= slabClassSize(sizeClass);
+	pthread_mutex_unlock(&allocator->mutex);
+}
+
+void slabDestroy(struct slabAllocator *allocator) {
+	int i;
+	for (i = 0; i < allocator->slabCount; i++)
+		free(allocator->slabs[i]);
+	free(allocator->slabs);
+	pthread_mutex_destroy(&allocator->mutex);
+	bzero(allocator, sizeof(struct slabAllocator));
+}
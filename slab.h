@@ -0,0 +1,38 @@
+//
+// Created by jmalcy on 11/26/20.
+//
+
+#ifndef HTTPPROXY_SLAB_H
+#define HTTPPROXY_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "macro.h"
+
+/**
+ * Fixed size chunks carved out of SLAB_BYTES slabs, one free list per power of two size class. Slabs are never handed
+ * back, so total memory is capped by the budget and a chunk freed in a class is reused by that class.
+ */
+struct slabAllocator {
+	void *freeLists[SLAB_CLASSES];
+	void **slabs;  // every slab allocated, for slabDestroy()
+	int slabCount;
+	size_t budget;
+	size_t allocated;  // bytes of slabs allocated so far
+	size_t inUse;  // bytes of chunks handed out
+	pthread_mutex_t mutex;
+};
+
+int slabInit(struct slabAllocator *allocator, size_t budget);
+
+int slabClass(size_t size);
+
+size_t slabClassSize(int sizeClass);
+
+void *slabAlloc(struct slabAllocator *allocator, int sizeClass);
+
+void slabFree(struct slabAllocator *allocator, void *chunk, int sizeClass);
+
+void slabDestroy(struct slabAllocator *allocator);
+
+#endif //HTTPPROXY_SLAB_H
@@ -0,0 +1,231 @@
+//
+// Created by jmalcy on 12/12/20.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize) {
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+/**
+ * Whether the kernel has everything the workers use: multishot poll and accept, waiting with a timeout, and never
+ * dropping a completion. Multishot accept came last, in 5.19 along with IORING_OP_SOCKET, so the probe looks for that.
+ */
+static int uringSupported(int fd, const struct io_uring_params *params) {
+	const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	struct io_uring_probe *probe;
+	int supported;
+
+	if ((params->features & needed) != needed)
+		return 0;
+	if ((probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op))) == NULL)
+		return 0;
+	supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+			probe->last_op >= IORING_OP_SOCKET;
+	free(probe);
+	return supported;
+}
+
+/**
+ * Sets up a ring with room for entries submissions at a time and four times as many completions.
+ * @return 0, or -1 with errno set if io_uring is missing, disabled, or too old for the workers.
+ */
+int uringInit(struct uring *ring, unsigned entries) {
+	struct io_uring_params params;
+	void *mapped;
+
+	bzero(ring, sizeof(struct uring));
+	bzero(&params, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = entries * 4;
+	if ((ring->fd = uringSetup(entries, &params)) < 0 && errno == EINVAL) {
+		params.flags &= ~IORING_SETUP_COOP_TASKRUN;  // only an optimization, and newer than the rest
+		ring->fd = uringSetup(entries, &params);
+	}
+	if (ring->fd < 0)
+		return -1;
+	if (!uringSupported(ring->fd, &params)) {
+		close(ring->fd);
+		ring->fd = -1;
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	// one mapping covers both rings, the entries themselves are mapped on their own
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->cqRingSize > ring->sqRingSize)
+		ring->sqRingSize = ring->cqRingSize;
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((mapped = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+	ring->sqRing = ring->cqRing = mapped;
+	if ((ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQES)) == MAP_FAILED) {
+		munmap(mapped, ring->sqRingSize);
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	ring->sqEntries = params.sq_entries;
+	ring->cqEntries = params.cq_entries;
+	ring->sqHead = (unsigned *)((char *)mapped + params.sq_off.head);
+	ring->sqTail = (unsigned *)((char *)mapped + params.sq_off.tail);
+	ring->sqMask = (unsigned *)((char *)mapped + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)((char *)mapped + params.sq_off.array);
+	ring->cqHead = (unsigned *)((char *)mapped + params.cq_off.head);
+	ring->cqTail = (unsigned *)((char *)mapped + params.cq_off.tail);
+	ring->cqMask = (unsigned *)((char *)mapped + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)mapped + params.cq_off.cqes);
+	return 0;
+}
+
+// hands everything queued to the kernel without waiting for anything to complete
+static int uringSubmit(struct uring *ring) {
+	int submitted;
+
+	while ((submitted = uringEnter(ring->fd, ring->sqPending, 0, 0, NULL, 0)) < 0 && errno == EINTR);
+	if (submitted < 0)
+		return -1;
+	ring->sqPending -= submitted;
+	return 0;
+}
+
+/**
+ * The next free submission entry, cleared. Nothing reaches the kernel until the next uringWait(), unless the ring is
+ * full, in which case what's queued is submitted right away to make room.
+ * @return The entry, or NULL if the ring is full and the kernel won't take any more.
+ */
+static struct io_uring_sqe *nextSqe(struct uring *ring) {
+	unsigned tail = *ring->sqTail, index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries && uringSubmit(ring) < 0) {
+		perror("Failed to submit to io_uring");
+		return NULL;
+	}
+
+	index = tail & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	ring->sqArray[index] = index;
+	return sqe;
+}
+
+// makes the entry nextSqe() handed out part of the next submission
+static void queueSqe(struct uring *ring) {
+	__atomic_store_n(ring->sqTail, *ring->sqTail + 1, __ATOMIC_RELEASE);
+	ring->sqPending++;
+}
+
+/**
+ * Watches fd for events until cancelled, posting a completion with the ready events every time they happen, the way
+ * an edge triggered epoll registration would.
+ */
+void uringPoll(struct uring *ring, int fd, uint32_t events, uint64_t userData) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = nextSqe(ring)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = userData;
+	queueSqe(ring);
+}
+
+// accepts connections on the listening socket fd until cancelled, each completion carries a non-blocking client socket
+void uringAccept(struct uring *ring, int fd, uint64_t userData) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = nextSqe(ring)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = userData;
+	queueSqe(ring);
+}
+
+/**
+ * Cancels the request submitted with userData. It ends with a completion of its own, -ECANCELED and without
+ * IORING_CQE_F_MORE, the cancellation itself completes with user data 0.
+ */
+void uringCancel(struct uring *ring, uint64_t userData) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = nextSqe(ring)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = userData;
+	queueSqe(ring);
+}
+
+/**
+ * Submits everything queued and waits up to timeoutMs for a completion, all in one system call. Doesn't wait at all
+ * if there are completions already.
+ * @return 0, or -1 on error. A timeout is no error, there's just nothing to peek.
+ */
+int uringWait(struct uring *ring, int timeoutMs) {
+	struct __kernel_timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+	struct io_uring_getevents_arg arg;
+	unsigned waitFor = uringPeek(ring) == NULL;
+	int submitted;
+
+	bzero(&arg, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&timeout;
+	submitted = uringEnter(ring->fd, ring->sqPending, waitFor, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+			sizeof(arg));
+	if (submitted < 0)  // EBUSY says completions are backed up in the kernel, reaping some makes room
+		return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+	ring->sqPending -= submitted;
+	return 0;
+}
+
+// the oldest completion not yet seen, or NULL if there's none
+struct io_uring_cqe *uringPeek(struct uring *ring) {
+	unsigned head = *ring->cqHead;
+
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+// done with the completion uringPeek() returned, its slot goes back to the kernel
+void uringSeen(struct uring *ring) {
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// closing the ring cancels whatever is still running on it
+void uringFree(struct uring *ring) {
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+	ring->fd = -1;
+}
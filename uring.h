@@ -0,0 +1,60 @@
+//
+// Created by jmalcy on 12/12/20.
+//
+
+#ifndef HTTPPROXY_URING_H
+#define HTTPPROXY_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include "macro.h"
+
+/**
+ * An io_uring instance set up through the raw system calls. The kernel and this side each own one end of both rings:
+ * we fill submission entries and move the SQ tail, the kernel posts completions and moves the CQ tail, and the heads
+ * follow the other way. Only ever used by the thread that owns it.
+ */
+struct uring {
+	int fd;
+	unsigned sqEntries;
+	unsigned cqEntries;
+
+	// the submission ring, indices into sqes
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned sqPending;  // entries filled since the last io_uring_enter()
+
+	// the completion ring
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+
+	void *sqRing;  // the mappings, for uringFree()
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+};
+
+int uringInit(struct uring *ring, unsigned entries);
+
+void uringPoll(struct uring *ring, int fd, uint32_t events, uint64_t userData);
+
+void uringAccept(struct uring *ring, int fd, uint64_t userData);
+
+void uringCancel(struct uring *ring, uint64_t userData);
+
+int uringWait(struct uring *ring, int timeoutMs);
+
+struct io_uring_cqe *uringPeek(struct uring *ring);
+
+void uringSeen(struct uring *ring);
+
+void uringFree(struct uring *ring);
+
+#endif //HTTPPROXY_URING_H
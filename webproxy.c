@@ -1,226 +1,311 @@
-/**
- * server.c - A concurrent TCP webserver
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>      /* for fgets */
-#include <strings.h>     /* for bzero, bcopy */
-#include <unistd.h>      /* for read, write */
-#include <sys/socket.h>  /* for socket use */
-#include <netinet/in.h>
-#include <pthread.h>
-#include <signal.h>
-#include <fcntl.h>
-
-#include "macro.h"
-#include "request.h"
-#include "cache.h"
-
-static volatile int killed = 0;
-
-int open_listenfd(int port);
-
-void respond(int connfd);
-
-void *thread(void *vargp);
-
-void trimSpace(char *str);
-
-void interruptHandler(int useless) {
-	killed = 1;
-}
-
-
-int main(int argc, char **argv) {
-	int *connfdp;
-	int listenfd, port, index, threadCount = 0, threadArraySize = 1, cacheTimeout = 60;
-	socklen_t clientlen = sizeof(struct sockaddr_in);
-	struct sockaddr_in clientaddr;
-	struct cache *cache;
-	threadParams *tps;
-	pthread_mutex_t threadMutex;
-	pthread_t *threadIDs;
-
-	// init shared content
-	pthread_mutex_init(&threadMutex, NULL);
-
-	// register signal handler
-	signal(SIGINT, interruptHandler);
-	signal(SIGPIPE, SIG_IGN);
-
-
-	// check for incorrect usage
-	if (argc != 2 && argc != 3) {
-		fprintf(stderr, "usage: %s <port> [timeout]\n", argv[0]);
-		exit(0);
-	} else {
-		port = atoi(argv[1]);
-		if (argc == 3) {
-			cacheTimeout = atoi(argv[2]);
-
-			if (cacheTimeout <= 0) {
-				perror("Invalid cache timeout. Must be greater than 0");
-				return 1;
-			}
-		}
-	}
-
-	if (port < 1 || port > 65535) {
-		perror("Invalid port number provided");
-		return 1;
-	}
-
-	if ((cache = initCache(cacheTimeout)) == NULL) {
-		perror("Failed cache initialization");
-		return 1;
-	}
-
-	if ((threadIDs = malloc(sizeof(pthread_t) * threadArraySize)) == NULL) {
-		perror("Failed to allocate thread arrays");
-		clearCache(cache);
-		return 1;
-	}
-	// create the socket we'll use
-	if((listenfd = open_listenfd(port)) < 0) {
-		perror("Could not open socket");
-		free(threadIDs);
-		clearCache(cache);
-		return 1;
-	}
-
-	char *blackListName = "/blacklist";
-	char *bFN = malloc(strlen(cache->cacheDirectory) + strlen(blackListName) + 1);
-	strcpy(bFN, cache->cacheDirectory);
-	strcat(bFN, blackListName);
-	FILE *blacklist = fopen(bFN, "w");
-	free(bFN);
-
-	if (blacklist != NULL) {
-		const char *initBlacklist = "www.facebook.com\nwww.instagram.com\n34.102.136.180\n";
-		fwrite(initBlacklist, sizeof(char), strlen(initBlacklist), blacklist);
-		fclose(blacklist);
-	}
-
-	// while SIGINT not received
-	while (!killed) {
-		connfdp = (int *)malloc(sizeof(int));
-
-		// If received connection, spawn thread. Else, free allocated memory
-		if ((*connfdp = accept(listenfd, (struct sockaddr *) &clientaddr, &clientlen)) > 0){
-			tps = (threadParams *)malloc(sizeof(threadParams));
-			tps->cache = cache;
-			tps->numThreads = &threadCount;
-			tps->threadMutex = &threadMutex;
-			tps->connfd = connfdp;
-
-			if (threadCount == threadArraySize) {
-				threadArraySize *= 2;
-				threadIDs = (pthread_t *)realloc(threadIDs, sizeof(pthread_t) * threadArraySize);
-			}
-
-			pthread_create(&threadIDs[threadCount++], NULL, thread, (void *)tps);
-		}
-		else
-			free(connfdp);
-	}
-	printf("Ending proxy...\n");
-
-	// join all threads
-	for (index = 0; index < threadCount; index++)
-		pthread_join(threadIDs[index], NULL);
-	free(threadIDs);
-
-	pthread_mutex_destroy(&threadMutex);
-	clearCache(cache);
-	return 0;
-}
-
-/* thread routine */
-void *thread(void *vargp) {
-	threadParams *tps = (threadParams *)vargp;
-	FILE *serverResponse = NULL;
-	char errorMessage[] = "400 Bad Request\r\n";
-	int connfd = *tps->connfd;  // get the connection file descriptor
-	free(tps->connfd);  // don't need that anymore since it was just an int anyway
-
-	request *req = malloc(sizeof(request));
-	bzero(req, sizeof(request));
-
-	if (readRequest(connfd, req) == NULL) {  // receive data from client
-		send(connfd, errorMessage, strlen(errorMessage), 0);
-	} else if (parseRequest(req, tps->cache->cacheDirectory) == NULL) {  // parse data from client into readable format
-		send(connfd, errorMessage, strlen(errorMessage), 0);
-		free(req->originalBuffer);
-		free(req->requestHash);
-	} else {
-		// check if in cache
-		if ((serverResponse = cacheLookup(req->requestHash, tps->cache, LOCK_ENABLED)) == NULL) {  // cache lookup failed
-			printf("Requesting %s (%s)\n", req->requestPath, req->requestHash);
-			serverResponse = forwardRequest(req, tps->cache);
-			if ((int)serverResponse == 1) {
-				send(connfd, "403 FORBIDDEN", strlen("403 FORBIDDEN"), 0);
-			}
-		} else {
-			printf("Found %s (%s) in cache\n", req->requestPath, req->requestHash);
-		}
-
-		if (serverResponse != NULL && (int)serverResponse != 1)
-			sendResponse(connfd, serverResponse);
-
-		free(req->originalBuffer);
-		free(req->postProcessBuffer);
-	}
-
-	free(req);
-
-	close(connfd);  // close the socket
-	pthread_mutex_lock(tps->threadMutex);  // no idea if arithmetic operations are thread safe
-	*tps->numThreads--;
-	pthread_mutex_unlock(tps->threadMutex);
-	free(vargp);
-
-	return NULL;
-}
-
-/*
- * open_listenfd - open and return a listening socket on port
- * Returns -1 in case of failure 
- */
-int open_listenfd(int port) {
-	int listenfd, optval = 1, flags;
-	struct sockaddr_in serveraddr;
-
-	/* Create a socket descriptor */
-	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-		return -1;
-
-	/* Eliminates "Address already in use" error from bind. */
-	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
-	               (const void *) &optval, sizeof(int)) < 0)
-		return -1;
-
-	/* listenfd will be an endpoint for all requests to port
-	   on any IP address for this host */
-	bzero((char *) &serveraddr, sizeof(serveraddr));
-	serveraddr.sin_family = AF_INET;
-	serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serveraddr.sin_port = htons((unsigned short) port);
-	if (bind(listenfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0)
-		return -1;
-
-	if ((flags = fcntl(listenfd, F_GETFL, 0)) < 0)
-	{
-		return -1;
-	}
-	if (fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0)
-	{
-		return -1;
-	}
-
-	/* Make it a listening socket ready to accept connection requests */
-	if (listen(listenfd, LISTENQ) < 0)
-		return -1;
-	return listenfd;
-} /* end open_listenfd */
-
+/**
+ * server.c - A concurrent TCP webserver
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>      /* for fgets */
+#include <strings.h>     /* for bzero, bcopy */
+#include <unistd.h>      /* for read, write */
+#include <sys/socket.h>  /* for socket use */
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+
+#include "macro.h"
+#include "request.h"
+#include "cache.h"
+#include "worker.h"
+#include "pool.h"
+#include "dns.h"
+#include "blacklist.h"
+#include "logger.h"
+
+static volatile int killed = 0;
+static volatile int reloadRequested = 0;
+static struct blacklist *blacklist = NULL;  // read by the workers without locking, only ever swapped whole
+
+int open_listenfd(int port, int reusePort);
+
+void trimSpace(char *str);
+
+void interruptHandler(int useless) {
+	killed = 1;
+}
+
+void reloadHandler(int useless) {
+	reloadRequested = 1;
+}
+
+// compiles the blacklist file again and swaps it in, the old one is freed once no worker can still be using it
+static void reloadBlacklist(const char *fileName, struct worker *workers, int workerCount) {
+	struct blacklist *fresh, *old;
+
+	if ((fresh = loadBlacklist(fileName)) == NULL)
+		return;  // keep enforcing the old one
+	old = __atomic_exchange_n(&blacklist, fresh, __ATOMIC_ACQ_REL);
+	quiesceWorkers(workers, workerCount);
+	freeBlacklist(old);
+	logMessage(LOG_INFO, "Reloaded blacklist: %d hosts, %d prefixes", fresh->hostCount, fresh->prefixCount);
+}
+
+// closes what openListeners() opened, a shared listener only once
+static void closeListeners(int *listenfds, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (i == 0 || listenfds[i] != listenfds[0])
+			close(listenfds[i]);
+	}
+	free(listenfds);
+}
+
+/**
+ * A listening socket for each of count workers: the same one for all of them, or with reusePort one each, all bound
+ * to port with SO_REUSEPORT so the kernel hands every worker its own share of the connections.
+ * @return The sockets, or NULL if any couldn't be opened.
+ */
+static int *openListeners(int port, int count, int reusePort) {
+	int *listenfds, i;
+
+	if ((listenfds = malloc(sizeof(int) * count)) == NULL)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		if (i > 0 && !reusePort) {
+			listenfds[i] = listenfds[0];
+		} else if ((listenfds[i] = open_listenfd(port, reusePort)) < 0) {
+			closeListeners(listenfds, i);
+			return NULL;
+		}
+	}
+	return listenfds;
+}
+
+
+int main(int argc, char **argv) {
+	int *listenfds, port, cacheTimeout = 60, workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN), memoryMB = MEMORY_CACHE_MB;
+	int staleGrace = STALE_GRACE_SECONDS, backend = BACKEND_EPOLL, reusePort = 0;
+	struct cache *cache;
+	struct worker *workers;
+	struct upstreamPool *pool;
+	struct dnsCache *dns;
+	sigset_t blockedSignals, waitMask;
+	const char *cacheDirectory = NULL;
+
+	// register signal handler
+	signal(SIGINT, interruptHandler);
+	signal(SIGHUP, reloadHandler);
+	signal(SIGPIPE, SIG_IGN);
+
+
+	// check for incorrect usage
+	if (argc < 2 || argc > 9) {
+		fprintf(stderr, "usage: %s <port> [timeout] [workers] [memory MB] [cache directory | -] [stale grace] "
+				"[epoll | io_uring] [shared | reuseport]\n", argv[0]);
+		exit(0);
+	} else {
+		port = atoi(argv[1]);
+		if (argc >= 3) {
+			cacheTimeout = atoi(argv[2]);
+
+			if (cacheTimeout <= 0) {
+				perror("Invalid cache timeout. Must be greater than 0");
+				return 1;
+			}
+		}
+		if (argc >= 4) {
+			workerCount = atoi(argv[3]);
+
+			if (workerCount <= 0) {
+				perror("Invalid worker count. Must be greater than 0");
+				return 1;
+			}
+		}
+		if (argc >= 5) {
+			memoryMB = atoi(argv[4]);
+
+			if (memoryMB < 0) {
+				perror("Invalid memory budget. Must be 0 or more");
+				return 1;
+			}
+		}
+		if (argc >= 6 && strcmp(argv[5], "-") != 0)
+			cacheDirectory = argv[5];  // kept across restarts, the cache warm starts from it
+		if (argc >= 7) {
+			staleGrace = atoi(argv[6]);
+
+			if (staleGrace < 0) {
+				perror("Invalid stale grace. Must be 0 or more");
+				return 1;
+			}
+		}
+		if (argc >= 8) {
+			if (strcmp(argv[7], "io_uring") == 0) {
+				backend = BACKEND_URING;
+			} else if (strcmp(argv[7], "epoll") != 0) {
+				fprintf(stderr, "Invalid backend %s. Must be epoll or io_uring\n", argv[7]);
+				return 1;
+			}
+		}
+		if (argc == 9) {
+			// a listener per worker, and every worker pinned to a core of its own
+			if (strcmp(argv[8], "reuseport") == 0) {
+				reusePort = 1;
+			} else if (strcmp(argv[8], "shared") != 0) {
+				fprintf(stderr, "Invalid listener mode %s. Must be shared or reuseport\n", argv[8]);
+				return 1;
+			}
+		}
+	}
+
+	if (port < 1 || port > 65535) {
+		perror("Invalid port number provided");
+		return 1;
+	}
+
+	// the workers accept and serve connections on their own event loops until SIGINT. Every thread started from here
+	// on inherits a mask blocking SIGINT and SIGHUP, so both always land on the main thread in sigsuspend().
+	sigemptyset(&blockedSignals);
+	sigaddset(&blockedSignals, SIGINT);
+	sigaddset(&blockedSignals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &blockedSignals, &waitMask);
+	startLogger(LOG_LEVEL);
+
+	if ((cache = initCache(cacheTimeout, staleGrace, (size_t)memoryMB * 1024 * 1024, cacheDirectory)) == NULL) {
+		perror("Failed cache initialization");
+		stopLogger();
+		return 1;
+	}
+
+	// create the sockets we'll use
+	if ((listenfds = openListeners(port, workerCount, reusePort)) == NULL) {
+		perror("Could not open socket");
+		clearCache(cache);
+		stopLogger();
+		return 1;
+	}
+
+	char *blackListName = "/blacklist";
+	char *bFN = malloc(strlen(cache->cacheDirectory) + strlen(blackListName) + 1);
+	strcpy(bFN, cache->cacheDirectory);
+	strcat(bFN, blackListName);
+	FILE *blacklistFile = fopen(bFN, "wx");  // a persistent cache directory keeps the blacklist it has
+
+	if (blacklistFile != NULL) {
+		const char *initBlacklist = "www.facebook.com\nwww.instagram.com\n34.102.136.180\n";
+		fwrite(initBlacklist, sizeof(char), strlen(initBlacklist), blacklistFile);
+		fclose(blacklistFile);
+	}
+
+	// compiled once here and again on SIGHUP, never re-read per request
+	if ((blacklist = loadBlacklist(bFN)) == NULL) {
+		free(bFN);
+		closeListeners(listenfds, workerCount);
+		clearCache(cache);
+		stopLogger();
+		return 1;
+	}
+
+	if ((pool = initPool(POOL_MAX_IDLE, POOL_MAX_IDLE_HOST, POOL_IDLE_SECONDS)) == NULL) {
+		freeBlacklist(blacklist);
+		free(bFN);
+		closeListeners(listenfds, workerCount);
+		clearCache(cache);
+		stopLogger();
+		return 1;
+	}
+
+	if ((dns = initDnsCache(DNS_TTL_SECONDS, DNS_NEGATIVE_SECONDS)) == NULL) {
+		closeListeners(listenfds, workerCount);
+		clearPool(pool);
+		freeBlacklist(blacklist);
+		free(bFN);
+		clearCache(cache);
+		stopLogger();
+		return 1;
+	}
+	loadDnsCache(dns, cache->dnsFile);
+
+	if ((workers = startWorkers(workerCount, backend, listenfds, reusePort, cache, pool, dns, &blacklist, &killed)) ==
+			NULL) {
+		closeListeners(listenfds, workerCount);
+		clearDnsCache(dns);
+		clearPool(pool);
+		freeBlacklist(blacklist);
+		free(bFN);
+		clearCache(cache);
+		stopLogger();
+		return 1;
+	}
+
+	while (!killed) {
+		sigsuspend(&waitMask);
+		if (reloadRequested) {
+			reloadRequested = 0;
+			reloadBlacklist(bFN, workers, workerCount);
+		}
+	}
+	logMessage(LOG_INFO, "Ending proxy...");
+
+	joinWorkers(workers, workerCount);
+	closeListeners(listenfds, workerCount);
+	clearPool(pool);
+	freeBlacklist(blacklist);
+	free(bFN);
+	saveDnsCache(dns, cache->dnsFile);
+	clearDnsCache(dns);
+
+	clearCache(cache);
+	stopLogger();
+	return 0;
+}
+
+/*
+ * open_listenfd - open and return a listening socket on port, one of several
+ * bound to it if reusePort is set
+ * Returns -1 in case of failure 
+ */
+int open_listenfd(int port, int reusePort) {
+	int listenfd, optval = 1, flags;
+	struct sockaddr_in serveraddr;
+
+	/* Create a socket descriptor */
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	/* Eliminates "Address already in use" error from bind. */
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+	               (const void *) &optval, sizeof(int)) < 0)
+		return -1;
+
+	/* Lets every worker bind a listener of its own, the kernel spreads
+	   new connections across them */
+	if (reusePort && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+	               (const void *) &optval, sizeof(int)) < 0)
+		return -1;
+
+	/* listenfd will be an endpoint for all requests to port
+	   on any IP address for this host */
+	bzero((char *) &serveraddr, sizeof(serveraddr));
+	serveraddr.sin_family = AF_INET;
+	serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serveraddr.sin_port = htons((unsigned short) port);
+	if (bind(listenfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0)
+		return -1;
+
+	if ((flags = fcntl(listenfd, F_GETFL, 0)) < 0)
+	{
+		return -1;
+	}
+	if (fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		return -1;
+	}
+
+	/* Make it a listening socket ready to accept connection requests */
+	if (listen(listenfd, LISTENQ) < 0)
+		return -1;
+	return listenfd;
+} /* end open_listenfd */
+
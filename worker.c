@@ -0,0 +1,914 @@
+//
+// Created by jmalcy on 11/24/20.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include "worker.h"
+#include "macro.h"
+#include "logger.h"
+
+static void *workerLoop(void *vargp);
+
+static int watchSocket(struct worker *w, int fd, eventHandle *handle, uint32_t events);
+
+static void acceptConnections(struct worker *w);
+
+static void openClient(struct worker *w, int connfd);
+
+static connection *newConnection(struct worker *w, int connfd);
+
+static void advanceConnection(connection *conn);
+
+static void wakeParked(struct worker *w);
+
+static int leadFetch(connection *conn);
+
+static void refreshInBackground(connection *conn);
+
+static int connectUpstream(connection *conn, struct upstreamPool *pool);
+
+static void dropUpstream(connection *conn);
+
+static void releaseUpstream(connection *conn);
+
+static void closeConnection(connection *conn);
+
+static void finishReply(connection *conn);
+
+static void closeIdleConnections(struct worker *w);
+
+static void replyAndClose(connection *conn, const char *message);
+
+static int sendReply(connection *conn);
+
+static void forbid(connection *conn);
+
+static void replyStats(connection *conn);
+
+/**
+ * Gives w what it waits on: an epoll instance or an io_uring, watching its eventfd and the listener.
+ * @return 0, or -1 if any of it couldn't be set up, with nothing left open.
+ */
+static int openEvents(struct worker *w) {
+	if ((w->notifyfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("Failed to create worker notification");
+		return -1;
+	}
+
+	if (w->backend == BACKEND_URING) {
+		// the ring has the kernel accept for it, on a shared listener whichever worker's accept is woken first wins
+		w->epollfd = -1;
+		uringPoll(&w->ring, w->notifyfd, POLLIN, (uintptr_t)&w->notifier);
+		uringAccept(&w->ring, w->listenfd, (uintptr_t)&w->listener);
+		return 0;
+	}
+
+	if ((w->epollfd = epoll_create1(0)) < 0) {
+		perror("Failed to create epoll instance");
+		close(w->notifyfd);
+		return -1;
+	}
+	// when every worker waits on the same listener, EPOLLEXCLUSIVE keeps a new connection from waking all of them
+	if (watchSocket(w, w->notifyfd, &w->notifier, EPOLLIN) < 0 ||
+			watchSocket(w, w->listenfd, &w->listener, EPOLLIN | EPOLLEXCLUSIVE) < 0) {
+		close(w->notifyfd);
+		close(w->epollfd);
+		return -1;
+	}
+	return 0;
+}
+
+// the n-th core the process may run on, counting around again past the last one, or -1 if that can't be told
+static int nthCpu(int n) {
+	cpu_set_t allowed;
+	int cpu, count;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || (count = CPU_COUNT(&allowed)) == 0)
+		return -1;
+	n %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+// starts w's thread, on its own core if it has one
+static int startThread(struct worker *w) {
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int failed;
+
+	pthread_attr_init(&attr);
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	failed = pthread_create(&w->id, &attr, workerLoop, w) != 0;
+	pthread_attr_destroy(&attr);
+	return failed ? -1 : 0;
+}
+
+/**
+ * Stops the first count workers after a later one failed to start. killed gets them out of their loops, and each is
+ * woken through its eventfd so it doesn't sit out the rest of its wait first. Then they're joined and released.
+ */
+static void stopStarted(struct worker *workers, int count, volatile int *killed) {
+	uint64_t one = 1;
+	int i;
+
+	*killed = 1;
+	for (i = 0; i < count; i++) {
+		if (write(workers[i].notifyfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("Failed to wake worker");
+	}
+	joinWorkers(workers, count);
+}
+
+/**
+ * Spawns count event loop threads. Each owns an epoll instance or an io_uring and the connections it accepted, so a
+ * connection is only ever touched by one thread.
+ * @param backend BACKEND_EPOLL, or BACKEND_URING to use io_uring if the kernel has what it takes and epoll otherwise.
+ * @param listenfds The listener each worker accepts on, the same one for all of them or one each.
+ * @param pinned Keep every worker on a core of its own, so what it allocates and touches stays in that core's caches
+ * and on its memory node. Workers outnumbering cores share them round robin.
+ * @return The worker array, or NULL if none could be started.
+ */
+struct worker *startWorkers(int count, int backend, const int *listenfds, int pinned, struct cache *cache,
+		struct upstreamPool *pool, struct dnsCache *dns, struct blacklist **blacklist, volatile int *killed) {
+	int i;
+	struct worker *workers;
+	workerMetrics *metrics;
+
+	if ((workers = calloc(count, sizeof(struct worker))) == NULL ||
+			(metrics = calloc(count, sizeof(workerMetrics))) == NULL) {
+		perror("Failed to allocate workers");
+		free(workers);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct worker *w = &workers[i];
+		w->index = i;
+		w->metrics = &metrics[i];
+		w->workers = workers;
+		w->workerCount = count;
+		w->listenfd = listenfds[i];
+		w->cpu = pinned ? nthCpu(i) : -1;
+		w->cache = cache;
+		w->pool = pool;
+		w->dns = dns;
+		w->blacklist = blacklist;
+		w->killed = killed;
+		w->listener.type = HANDLE_LISTENER;
+		w->notifier.type = HANDLE_NOTIFY;
+
+		// decided by the first worker, they all end up on the same one
+		w->backend = backend;
+		if (backend == BACKEND_URING && uringInit(&w->ring, URING_ENTRIES) < 0) {
+			if (i > 0) {
+				perror("Failed to create io_uring");
+				stopStarted(workers, i, killed);
+				return NULL;
+			}
+			logMessage(LOG_WARN, "io_uring unavailable (%s), using epoll", strerror(errno));
+			w->backend = backend = BACKEND_EPOLL;
+		}
+
+		if (openEvents(w) < 0) {
+			if (w->backend == BACKEND_URING)
+				uringFree(&w->ring);
+			stopStarted(workers, i, killed);
+			return NULL;
+		}
+
+		if (startThread(w) < 0) {
+			perror("Failed to start worker thread");
+			close(w->notifyfd);
+			if (w->backend == BACKEND_URING)
+				uringFree(&w->ring);
+			else
+				close(w->epollfd);
+			stopStarted(workers, i, killed);
+			return NULL;
+		}
+	}
+	if (backend == BACKEND_URING)
+		logMessage(LOG_INFO, "Workers waiting on io_uring");
+	if (pinned)
+		logMessage(LOG_INFO, "Workers pinned to cores, each with a listener of its own");
+
+	return workers;
+}
+
+/**
+ * Returns once every worker has gone around its event loop at least once. Whatever a worker read through a shared
+ * pointer before this was called, it no longer holds on to, so the old target of a swapped pointer can be freed.
+ */
+void quiesceWorkers(struct worker *workers, int count) {
+	unsigned long *seen;
+	struct timespec pause = {0, 10 * 1000 * 1000};
+	int i;
+
+	if ((seen = malloc(sizeof(unsigned long) * count)) == NULL) {
+		perror("Failed to wait for workers");
+		return;
+	}
+	for (i = 0; i < count; i++)
+		seen[i] = __atomic_load_n(&workers[i].passes, __ATOMIC_ACQUIRE);
+
+	// a worker that has stopped, or is stopping, holds nothing either. Its loop can end on an error without killed.
+	for (i = 0; i < count; i++) {
+		while (__atomic_load_n(&workers[i].passes, __ATOMIC_ACQUIRE) == seen[i] && !*workers[i].killed &&
+				!__atomic_load_n(&workers[i].exited, __ATOMIC_ACQUIRE))
+			nanosleep(&pause, NULL);
+	}
+	free(seen);
+}
+
+// waits for count workers to notice shutdown, then releases them
+void joinWorkers(struct worker *workers, int count) {
+	int i;
+	for (i = 0; i < count; i++)
+		pthread_join(workers[i].id, NULL);
+
+	// only once all are stopped, a leader on one worker may still poke another's eventfd while closing
+	for (i = 0; i < count; i++) {
+		close(workers[i].notifyfd);
+		if (workers[i].backend == BACKEND_URING)
+			uringFree(&workers[i].ring);  // cancels the polls and accepts still on it
+		else
+			close(workers[i].epollfd);
+	}
+	free(workers[0].metrics);  // one allocation for all of them
+	free(workers);
+}
+
+/**
+ * Starts reporting readiness of fd to handle, edge triggered: once for every change, however much is left unread.
+ * Under io_uring that's a multishot poll, which holds on to the socket until it's cancelled.
+ * @return 0, or -1 if it couldn't be registered.
+ */
+static int watchSocket(struct worker *w, int fd, eventHandle *handle, uint32_t events) {
+	struct epoll_event event;
+
+	if (w->backend == BACKEND_URING) {
+		uringPoll(&w->ring, fd, events, (uintptr_t)handle);
+		if (handle->conn != NULL)
+			handle->conn->watches++;
+		return 0;
+	}
+
+	bzero(&event, sizeof(event));
+	event.events = events | EPOLLET;
+	event.data.ptr = handle;
+	if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		perror("Failed to watch socket");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Stops reporting on fd, before it's closed or handed to another worker. Closing is enough for epoll, but a poll on
+ * the ring keeps the socket open until the cancellation goes in with the next wait.
+ */
+static void unwatchSocket(struct worker *w, int fd, eventHandle *handle, int closing) {
+	if (w->backend == BACKEND_URING)
+		uringCancel(&w->ring, (uintptr_t)handle);
+	else if (!closing)
+		epoll_ctl(w->epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// the fd a handle of conn watches, and what for
+static int handleSocket(eventHandle *handle, uint32_t *events) {
+	*events = handle->type == HANDLE_CLIENT ? EPOLLIN | EPOLLOUT | EPOLLRDHUP : EPOLLIN | EPOLLOUT;
+	return handle->type == HANDLE_CLIENT ? handle->conn->connfd : handle->conn->res.serverfd;
+}
+
+/**
+ * Handles everything the ring completed since the last wait, the io_uring counterpart of a batch of epoll events.
+ * Accepted sockets arrive with their completion instead of needing an accept() call. A completion without
+ * IORING_CQE_F_MORE is the last of its request, it's armed again unless it was cancelled.
+ */
+static void reapCompletions(struct worker *w) {
+	struct io_uring_cqe *cqe;
+	eventHandle *handle;
+	uint32_t events;
+	int result, more, fd;
+
+	while ((cqe = uringPeek(&w->ring)) != NULL) {
+		handle = (eventHandle *)(uintptr_t)cqe->user_data;
+		result = cqe->res;
+		more = cqe->flags & IORING_CQE_F_MORE;
+		uringSeen(&w->ring);
+
+		if (handle == NULL) {  // a cancellation went through
+			continue;
+		} else if (handle->type == HANDLE_LISTENER) {
+			if (result >= 0)
+				openClient(w, result);
+			else if (result != -EAGAIN && result != -ECONNABORTED)
+				logMessage(LOG_WARN, "Failed to accept connection: %s", strerror(-result));
+			if (!more)
+				uringAccept(&w->ring, w->listenfd, (uintptr_t)&w->listener);
+			continue;
+		} else if (handle->type == HANDLE_NOTIFY) {
+			wakeParked(w);
+			if (!more)
+				uringPoll(&w->ring, w->notifyfd, POLLIN, (uintptr_t)&w->notifier);
+			continue;
+		}
+
+		if (!more)
+			handle->conn->watches--;
+		if (handle->conn->state == CONN_CLOSED || result == -ECANCELED)
+			continue;  // the socket it was about is gone or went back to the pool
+		if (!more && result >= 0 && (fd = handleSocket(handle, &events)) >= 0)
+			watchSocket(w, fd, handle, events);
+		advanceConnection(handle->conn);
+	}
+}
+
+// a connection may have several events in one batch, and polls on the ring still to end, so it's only freed after
+static void freeClosed(struct worker *w, int stopping) {
+	connection *conn, **link = &w->closed;
+
+	while ((conn = *link) != NULL) {
+		if (conn->watches > 0 && !stopping) {
+			link = &conn->next;
+			continue;
+		}
+		*link = conn->next;
+		free(conn);
+	}
+}
+
+static void *workerLoop(void *vargp) {
+	struct worker *w = (struct worker *)vargp;
+	struct epoll_event events[MAX_EVENTS];
+	eventHandle *handle;
+	int i, numEvents;
+
+	while (!*w->killed) {
+		__atomic_add_fetch(&w->passes, 1, __ATOMIC_RELEASE);
+		if (w->backend == BACKEND_URING) {
+			if (uringWait(&w->ring, EPOLL_TIMEOUT_MS) < 0) {
+				perror("io_uring_enter failed");
+				break;
+			}
+			reapCompletions(w);
+		} else {
+			numEvents = epoll_wait(w->epollfd, events, MAX_EVENTS, EPOLL_TIMEOUT_MS);
+			if (numEvents < 0 && errno != EINTR) {
+				perror("epoll_wait failed");
+				break;
+			}
+
+			for (i = 0; i < numEvents; i++) {
+				handle = (eventHandle *)events[i].data.ptr;
+
+				if (handle->type == HANDLE_LISTENER)
+					acceptConnections(w);
+				else if (handle->type == HANDLE_NOTIFY)
+					wakeParked(w);
+				else if (handle->conn->state != CONN_CLOSED)
+					advanceConnection(handle->conn);
+			}
+		}
+
+		closeIdleConnections(w);
+		freeClosed(w, 0);
+	}
+
+	// nothing is reaped from the ring any more, it goes away with everything still on it
+	while (w->connections != NULL)
+		closeConnection(w->connections);
+	freeClosed(w, 1);
+
+	__atomic_store_n(&w->exited, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void acceptConnections(struct worker *w) {
+	int connfd;
+	struct sockaddr_in clientaddr;
+	socklen_t clientlen = sizeof(struct sockaddr_in);
+
+	// edge triggered, so keep going until the backlog is empty
+	while ((connfd = accept4(w->listenfd, (struct sockaddr *) &clientaddr, &clientlen, SOCK_NONBLOCK)) >= 0) {
+		clientlen = sizeof(struct sockaddr_in);
+		openClient(w, connfd);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+		logMessage(LOG_ERROR, "Failed to accept connection: %s", strerror(errno));
+}
+
+// starts serving a newly accepted client socket
+static void openClient(struct worker *w, int connfd) {
+	connection *conn;
+
+	if ((conn = newConnection(w, connfd)) == NULL) {
+		close(connfd);
+		return;
+	}
+	if (watchSocket(w, connfd, &conn->client, EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0)
+		closeConnection(conn);
+}
+
+/**
+ * Sets up a connection owned by w, waiting for a request. connfd is the client socket, or -1 for a connection that
+ * only fetches for the cache and has no client.
+ * @return The connection, or NULL if it couldn't be allocated.
+ */
+static connection *newConnection(struct worker *w, int connfd) {
+	connection *conn;
+
+	if ((conn = calloc(1, sizeof(connection))) == NULL) {
+		perror("Failed to allocate connection");
+		return NULL;
+	}
+	conn->connfd = connfd;
+	conn->state = CONN_READING;
+	conn->clientGone = connfd < 0;
+	conn->lastActive = time(NULL);
+	initResponse(&conn->res);
+	conn->res.waiter.notifyfd = w->notifyfd;
+	conn->resolver.notifyfd = w->notifyfd;
+	conn->worker = w;
+	conn->client.type = HANDLE_CLIENT;
+	conn->client.conn = conn;
+	conn->server.type = HANDLE_SERVER;
+	conn->server.conn = conn;
+
+	conn->next = w->connections;
+	if (w->connections != NULL)
+		w->connections->prev = conn;
+	w->connections = conn;
+	return conn;
+}
+
+/**
+ * Runs the connection's state machine as far as it can go without blocking. Every stage returns IO_AGAIN when its
+ * socket isn't ready, and the next edge on either socket picks things back up from the same state.
+ */
+static void advanceConnection(connection *conn) {
+	struct worker *w = conn->worker;
+	cacheHit hit;
+	int status = IO_DONE, fetchStatus, headDone;
+	off_t available;
+
+	conn->lastActive = time(NULL);
+	while (status == IO_DONE && conn->state != CONN_CLOSED) {
+		switch (conn->state) {
+			case CONN_READING:
+				if ((status = readRequest(conn->connfd, &conn->req)) != IO_DONE)
+					break;
+
+				if (parseRequest(&conn->req) < 0) {
+					countMetric(w->metrics, COUNTER_ERRORS, 1);
+					replyAndClose(conn, "400 Bad Request\r\n");
+					return;
+				}
+				if (strncmp(conn->req.requestPath, STATS_PATH, strlen(STATS_PATH)) == 0 &&
+						(conn->req.requestPath[strlen(STATS_PATH)] == '\0' ||
+						conn->req.requestPath[strlen(STATS_PATH)] == '?')) {
+					replyStats(conn);
+					return;
+				}
+				countMetric(w->metrics, COUNTER_REQUESTS, 1);
+				conn->startedAt = metricsClock();
+
+				// check if in cache, memory first then disk
+				if (cacheLookup(conn->req.requestKey, w->cache, LOCK_ENABLED, 1, &hit) == 0) {
+					if (hit.memory != NULL)
+						logMessage(LOG_INFO, "Found %s (%s) in memory", conn->req.requestPath, conn->req.requestHash);
+					else
+						logMessage(LOG_INFO, "Found %s (%s) in cache", conn->req.requestPath, conn->req.requestHash);
+					conn->res.memory = hit.memory;
+					conn->res.cacheFd = hit.fd;
+					conn->res.framed = hit.framed;
+					conn->state = CONN_SENDING;
+					conn->histogram = HISTOGRAM_HIT;
+					countMetric(w->metrics, COUNTER_HITS, 1);
+					countMetric(w->metrics, COUNTER_MEMORY_HITS, hit.memory != NULL);
+					countMetric(w->metrics, COUNTER_STALE_HITS, hit.stale);
+					if (hit.stale)
+						refreshInBackground(conn);
+					break;
+				}
+
+				// only one connection fetches any given object, the rest read along with it
+				fetchStatus = joinFetch(conn->req.requestKey, conn->req.requestHash, w->cache, &conn->res.waiter,
+						&conn->res.fetch, &hit);
+				conn->res.memory = hit.memory;
+				conn->res.cacheFd = hit.fd;
+				conn->res.framed = hit.framed;
+				conn->histogram = fetchStatus == FETCH_HIT ? HISTOGRAM_HIT : HISTOGRAM_MISS;
+				switch (fetchStatus) {
+					case FETCH_HIT:
+						logMessage(LOG_INFO, "Found %s (%s) in cache", conn->req.requestPath, conn->req.requestHash);
+						conn->state = CONN_SENDING;
+						countMetric(w->metrics, COUNTER_HITS, 1);
+						countMetric(w->metrics, COUNTER_MEMORY_HITS, hit.memory != NULL);
+						countMetric(w->metrics, COUNTER_STALE_HITS, hit.stale);
+						if (hit.stale)
+							refreshInBackground(conn);
+						continue;
+					case FETCH_FOLLOWER:
+						logMessage(LOG_INFO, "Joining fetch of %s (%s)", conn->req.requestPath, conn->req.requestHash);
+						conn->state = CONN_FOLLOWING;
+						conn->upstreamActive = time(NULL);
+						countMetric(w->metrics, COUNTER_COALESCED, 1);
+						continue;
+					case FETCH_LEADER:
+						countMetric(w->metrics, COUNTER_MISSES, 1);
+						status = leadFetch(conn);
+						continue;
+					default:
+						status = IO_ERROR;
+						continue;
+				}
+			case CONN_RESOLVING:
+				if (blacklistedHost(__atomic_load_n(w->blacklist, __ATOMIC_ACQUIRE), conn->req.host)) {
+					status = IO_FORBIDDEN;
+					break;
+				}
+
+				// the resolver threads wake this worker's eventfd once the answer is in
+				if ((status = dnsResolve(w->dns, conn->req.host, &conn->resolver, &conn->res.destination)) ==
+						DNS_PENDING) {
+					status = IO_AGAIN;
+					break;
+				} else if (status == DNS_FAILED) {
+					logMessage(LOG_WARN, "Could not find hostname of specified host: %s", conn->req.host);
+					status = IO_ERROR;
+					break;
+				}
+				recordLatency(w->metrics, HISTOGRAM_DNS, metricsClock() - conn->stageAt);
+				conn->stageAt = metricsClock();
+
+				logMessage(LOG_INFO, "Requesting %s (%s)", conn->req.requestPath, conn->req.requestHash);
+				status = connectUpstream(conn, w->pool);
+				break;
+			case CONN_CONNECTING:
+			case CONN_FORWARDING:
+				conn->state = CONN_FORWARDING;
+				if ((status = sendRequest(&conn->req, &conn->res)) != IO_AGAIN)
+					conn->upstreamActive = time(NULL);
+				if (status == IO_DONE) {
+					conn->state = CONN_RECEIVING;
+					recordLatency(w->metrics, HISTOGRAM_CONNECT, metricsClock() - conn->stageAt);
+					conn->stageAt = metricsClock();
+				} else if (status == IO_RETRY)
+					status = connectUpstream(conn, NULL);
+				break;
+			case CONN_RECEIVING:
+				// tee: every piece that lands in the cache file goes straight on to the client. If the client
+				// goes away the fetch carries on, the cache and any followers still want the object.
+				headDone = conn->res.framer.headDone;
+				if ((status = receiveResponse(&conn->req, &conn->res)) == IO_RETRY) {
+					status = connectUpstream(conn, NULL);
+					break;
+				}
+				if (status != IO_AGAIN)
+					conn->upstreamActive = time(NULL);
+				if (!headDone && conn->res.framer.headDone)
+					recordLatency(w->metrics, HISTOGRAM_TTFB, metricsClock() - conn->stageAt);
+				if (status == IO_DONE)
+					releaseUpstream(conn);
+				if (status != IO_ERROR && !conn->clientGone && sendResponse(conn->connfd, &conn->res) == IO_ERROR)
+					conn->clientGone = 1;
+
+				if (status == IO_PARTIAL)
+					status = IO_DONE;
+				else if (status == IO_DONE && conn->clientGone)
+					closeConnection(conn);
+				else if (status == IO_DONE)
+					conn->state = CONN_SENDING;
+				break;
+			case CONN_FOLLOWING:
+				available = conn->res.available;
+				fetchStatus = followFetch(conn->res.fetch, &conn->res.waiter, conn->res.bytesSent, &conn->res.available);
+				if (fetchStatus != FETCH_RUNNING || conn->res.available != available)
+					conn->upstreamActive = time(NULL);
+				switch (fetchStatus) {
+					case FETCH_FORBIDDEN:
+						replyAndClose(conn, "403 FORBIDDEN");
+						return;
+					case FETCH_FAILED:
+						status = IO_ERROR;
+						break;
+					case FETCH_DONE:  // everything is in the file now, finish up like a hit
+						conn->res.framed = conn->res.fetch->framed;
+						conn->state = CONN_SENDING;
+						break;
+					default:
+						// parked until the leader publishes more if we've sent everything there is
+						if (conn->res.bytesSent >= conn->res.available)
+							status = IO_AGAIN;
+						else
+							status = sendResponse(conn->connfd, &conn->res);
+						break;
+				}
+				break;
+			case CONN_SENDING:
+				if ((status = sendResponse(conn->connfd, &conn->res)) == IO_DONE)
+					finishReply(conn);
+				break;
+			case CONN_REPLYING:
+				if ((status = sendReply(conn)) == IO_DONE)
+					closeConnection(conn);
+				break;
+			default:
+				status = IO_ERROR;
+				break;
+		}
+	}
+
+	if (status == IO_FORBIDDEN && conn->state != CONN_CLOSED) {
+		forbid(conn);
+	} else if (status == IO_ERROR && conn->state != CONN_CLOSED) {
+		if (conn->state != CONN_READING)  // a client hanging up between requests is no error
+			countMetric(w->metrics, COUNTER_ERRORS, 1);
+		closeConnection(conn);
+	}
+}
+
+// conn fetches for everyone, only asking whether the expired copy is still good if there is one to ask about
+static int leadFetch(connection *conn) {
+	conn->res.leading = 1;
+	conn->state = CONN_RESOLVING;
+	conn->stageAt = metricsClock();
+	if (conn->res.fetch->staleFd >= 0 && revalidateRequest(&conn->req, &conn->res.fetch->staleValidators) < 0)
+		return IO_ERROR;
+	return IO_DONE;
+}
+
+/**
+ * conn is being served a stale copy. Unless a fetch of the object is already running, a connection with no client is
+ * started on this worker to fetch it again, and the object is back to fresh in the cache when it's done.
+ */
+static void refreshInBackground(connection *conn) {
+	struct worker *w = conn->worker;
+	inflightFetch *fetch;
+	connection *refresh;
+	int fd;
+
+	if (refreshFetch(conn->req.requestKey, conn->req.requestHash, w->cache, &fetch, &fd) != FETCH_LEADER)
+		return;
+
+	if ((refresh = newConnection(w, -1)) == NULL) {
+		finishFetch(fetch, FETCH_FAILED);
+		leaveFetch(fetch, NULL);
+		close(fd);
+		return;
+	}
+	refresh->res.fetch = fetch;
+	refresh->res.cacheFd = fd;
+	refresh->res.leading = 1;  // from here on closing it tells anyone who joins that the refresh failed
+	if (cloneRequest(&refresh->req, &conn->req) < 0 || leadFetch(refresh) == IO_ERROR) {
+		closeConnection(refresh);
+		return;
+	}
+
+	logMessage(LOG_INFO, "Refreshing %s (%s) in the background", refresh->req.requestPath,
+			refresh->req.requestHash);
+	countMetric(w->metrics, COUNTER_REFRESHES, 1);
+	advanceConnection(refresh);
+}
+
+/**
+ * Gets a connection to the destination going, reused from the pool when there is one, and starts watching it.
+ * @param pool NULL after a pooled connection turned out dead, to force a fresh connect.
+ * @return IO_DONE with the connection in CONN_CONNECTING, IO_FORBIDDEN or IO_ERROR.
+ */
+static int connectUpstream(connection *conn, struct upstreamPool *pool) {
+	struct worker *w = conn->worker;
+	const struct blacklist *blacklist;
+	int status;
+
+	// a retry starts over on a clean socket, nothing has been written to the cache file yet
+	dropUpstream(conn);
+	conn->res.bytesForwarded = 0;
+	conn->res.totalReceived = 0;
+
+	blacklist = __atomic_load_n(w->blacklist, __ATOMIC_ACQUIRE);
+	if ((status = forwardRequest(&conn->req, &conn->res, blacklist, pool)) == IO_FORBIDDEN || status == IO_ERROR)
+		return status;
+
+	if (watchSocket(w, conn->res.serverfd, &conn->server, EPOLLIN | EPOLLOUT) < 0)
+		return IO_ERROR;
+
+	conn->state = CONN_CONNECTING;
+	conn->upstreamActive = time(NULL);
+	return IO_DONE;
+}
+
+// closes the connection to the destination, if there is one
+static void dropUpstream(connection *conn) {
+	if (conn->res.serverfd < 0)
+		return;
+	unwatchSocket(conn->worker, conn->res.serverfd, &conn->server, 1);
+	close(conn->res.serverfd);
+	conn->res.serverfd = -1;
+}
+
+// the response is in, a destination connection that's still good goes back to the pool for the next request to it
+static void releaseUpstream(connection *conn) {
+	if (conn->res.serverfd < 0 || !conn->res.keepAlive) {
+		dropUpstream(conn);
+		return;
+	}
+
+	// it may be picked up by another worker, so this one has to stop watching it first
+	unwatchSocket(conn->worker, conn->res.serverfd, &conn->server, 0);
+	checkinConnection(conn->worker->pool, conn->req.host, conn->req.port, conn->res.serverfd);
+	conn->res.serverfd = -1;
+}
+
+// a fetch some of this worker's connections follow has moved on, or a lookup they wait for is done
+static void wakeParked(struct worker *w) {
+	uint64_t count;
+	connection *conn, *next;
+
+	while (read(w->notifyfd, &count, sizeof(count)) > 0);
+
+	for (conn = w->connections; conn != NULL; conn = next) {
+		next = conn->next;  // advancing may close it
+		if (conn->state == CONN_FOLLOWING || conn->state == CONN_RESOLVING)
+			advanceConnection(conn);
+	}
+}
+
+/**
+ * The response has been sent in full. The connection goes back to reading if the client asked to keep it and will
+ * be able to tell where the response ended, whatever it pipelined behind this request is already in the buffer.
+ */
+static void finishReply(connection *conn) {
+	countMetric(conn->worker->metrics, COUNTER_BYTES_SERVED, conn->res.bytesSent);
+	recordLatency(conn->worker->metrics, conn->histogram, metricsClock() - conn->startedAt);
+
+	if (!conn->req.keepAlive || !conn->res.framed) {
+		closeConnection(conn);
+		return;
+	}
+
+	freeResponse(&conn->res);
+	conn->res.waiter.notifyfd = conn->worker->notifyfd;
+	nextRequest(&conn->req);
+	conn->state = CONN_READING;
+}
+
+/**
+ * Closes client connections idle between requests, or stuck on a reply, for too long, checked about once a second.
+ * Fetches the destination has stopped answering are given up the same way: a leader closing fails its fetch, which
+ * lets every follower go instead of leaving them waiting on it forever.
+ */
+static void closeIdleConnections(struct worker *w) {
+	time_t now = time(NULL);
+	connection *conn, *next;
+
+	if (now == w->lastSweep)
+		return;
+	w->lastSweep = now;
+
+	for (conn = w->connections; conn != NULL; conn = next) {
+		next = conn->next;
+		if ((conn->state == CONN_READING || conn->state == CONN_REPLYING) &&
+				now - conn->lastActive >= CLIENT_IDLE_SECONDS) {
+			closeConnection(conn);
+		} else if ((conn->state == CONN_CONNECTING || conn->state == CONN_FORWARDING ||
+				conn->state == CONN_RECEIVING || conn->state == CONN_FOLLOWING) &&
+				now - conn->upstreamActive >= UPSTREAM_IDLE_SECONDS) {
+			logMessage(LOG_WARN, "Gave up on %s (%s), nothing from the destination for %d seconds",
+					conn->req.requestPath, conn->req.requestHash, UPSTREAM_IDLE_SECONDS);
+			countMetric(w->metrics, COUNTER_ERRORS, 1);
+			closeConnection(conn);
+		}
+	}
+}
+
+// the destination is blacklisted, and so for everyone following this connection's fetch
+static void forbid(connection *conn) {
+	countMetric(conn->worker->metrics, COUNTER_FORBIDDEN, 1);
+	if (conn->res.leading) {
+		finishFetch(conn->res.fetch, FETCH_FORBIDDEN);
+		conn->res.leading = 0;
+	}
+	replyAndClose(conn, "403 FORBIDDEN");
+}
+
+/**
+ * Answers STATS_PATH with every worker's counters and latency histograms added up. Each worker only ever writes its
+ * own, so reading them takes no locks, and the numbers are at most a request or two behind.
+ */
+static void replyStats(connection *conn) {
+	struct worker *w = conn->worker;
+	workerMetrics *total;
+	char *body, *reply;
+	size_t length;
+	int i, json = strstr(conn->req.requestPath, "format=json") != NULL;
+
+	if ((total = calloc(1, sizeof(workerMetrics))) == NULL) {
+		perror("Failed to allocate stats");
+		closeConnection(conn);
+		return;
+	}
+	for (i = 0; i < w->workerCount; i++)
+		mergeMetrics(total, w->workers[i].metrics);
+
+	// the page is written out as the client takes it, so it lives as long as the request does
+	if ((body = formatMetrics(total, json, &length)) == NULL ||
+			(reply = arenaAlloc(&conn->req.arena, length + 256)) == NULL) {
+		free(body);
+		free(total);
+		closeConnection(conn);
+		return;
+	}
+	sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nCache-Control: no-store\r\n"
+			"Connection: close\r\n\r\n%s", json ? "application/json" : "text/plain; version=0.0.4", length, body);
+	replyAndClose(conn, reply);
+
+	free(body);
+	free(total);
+}
+
+/**
+ * Answers with a reply the proxy makes up itself and closes the connection once it's out. It's written as the client
+ * takes it, like any other response, so a client slow to read it holds up nobody else on the worker.
+ * @param message Has to last until the connection is closed, a constant or something from req.arena.
+ */
+static void replyAndClose(connection *conn, const char *message) {
+	if (conn->connfd < 0) {
+		closeConnection(conn);
+		return;
+	}
+
+	dropUpstream(conn);
+	conn->reply = message;
+	conn->replyLength = strlen(message);
+	conn->replySent = 0;
+	conn->state = CONN_REPLYING;
+	if (sendReply(conn) != IO_AGAIN)
+		closeConnection(conn);
+}
+
+// writes as much of the reply as the client socket takes
+static int sendReply(connection *conn) {
+	ssize_t sent;
+
+	while (conn->replySent < conn->replyLength) {
+		if ((sent = send(conn->connfd, conn->reply + conn->replySent, conn->replyLength - conn->replySent, 0)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return IO_AGAIN;
+			if (errno == EINTR)
+				continue;
+			return IO_ERROR;
+		}
+		conn->replySent += sent;
+	}
+	return IO_DONE;
+}
+
+// closes both sockets and queues the connection to be freed at the end of the current batch
+static void closeConnection(connection *conn) {
+	struct worker *w = conn->worker;
+
+	if (conn->state == CONN_CLOSED)
+		return;
+	conn->state = CONN_CLOSED;
+
+	if (conn->connfd >= 0) {
+		unwatchSocket(w, conn->connfd, &conn->client, 1);
+		close(conn->connfd);
+	}
+	dropUpstream(conn);
+	dnsCancel(w->dns, &conn->resolver);
+	freeResponse(&conn->res);
+	freeRequest(&conn->req);
+
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		w->connections = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	conn->next = w->closed;
+	w->closed = conn;
+}
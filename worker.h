@@ -0,0 +1,99 @@
+//
+// Created by jmalcy on 11/24/20.
+//
+
+#ifndef HTTPPROXY_WORKER_H
+#define HTTPPROXY_WORKER_H
+
+#include <pthread.h>
+#include <time.h>
+#include "request.h"
+#include "cache.h"
+#include "pool.h"
+#include "dns.h"
+#include "blacklist.h"
+#include "metrics.h"
+#include "uring.h"
+
+// what an epoll event's data.ptr points at
+#define HANDLE_LISTENER     0
+#define HANDLE_CLIENT       1
+#define HANDLE_SERVER       2
+#define HANDLE_NOTIFY       3
+
+// where a connection is in the request flow
+#define CONN_READING        0  // waiting for the client's next request
+#define CONN_RESOLVING      1  // waiting for a resolver thread to look up the destination
+#define CONN_CONNECTING     2  // non-blocking connect to the destination in progress
+#define CONN_FORWARDING     3  // writing the request to the destination
+#define CONN_RECEIVING      4  // reading the destination's response into the cache and on to the client
+#define CONN_SENDING        5  // writing the cached response back to the client
+#define CONN_FOLLOWING      6  // sending on another connection's fetch of the same object as it arrives
+#define CONN_REPLYING       7  // writing a reply the proxy made up itself, then closing
+#define CONN_CLOSED         8
+
+struct connection;
+struct worker;
+
+typedef struct {
+	int type;
+	struct connection *conn;
+} eventHandle;
+
+typedef struct connection {
+	int connfd;
+	int state;
+	int clientGone;  // the client hung up but we're still fetching for the cache
+	time_t lastActive;  // last time anything happened on it, for closing idle keep-alive connections
+	time_t upstreamActive;  // last time the fetch it leads or follows moved on, for failing stalled fetches
+	uint64_t startedAt;  // metricsClock() when the request being served was parsed
+	uint64_t stageAt;  // metricsClock() when the current step of fetching it began
+	int histogram;  // HISTOGRAM_HIT or HISTOGRAM_MISS, where the reply's latency is recorded
+	int watches;  // io_uring polls on its sockets not yet ended, it can't be freed while the kernel may report on them
+	const char *reply;  // what CONN_REPLYING writes out, a constant or from req.arena
+	size_t replyLength;
+	size_t replySent;
+	request req;
+	response res;
+	dnsWaiter resolver;
+	eventHandle client;
+	eventHandle server;
+	struct worker *worker;
+	struct connection *next;
+	struct connection *prev;
+} connection;
+
+struct worker {
+	pthread_t id;
+	int index;
+	int backend;  // BACKEND_EPOLL or BACKEND_URING
+	int epollfd;
+	int cpu;  // the core it's pinned to, -1 if it runs wherever the scheduler puts it
+	struct uring ring;
+	int listenfd;  // shared by all workers, or its own SO_REUSEPORT one
+	int notifyfd;  // eventfd poked when followers here can send more or a lookup they wait on is done
+	eventHandle listener;
+	eventHandle notifier;
+	connection *connections;  // every open connection owned by this worker
+	connection *closed;  // connections to free once the current batch of events is handled
+	time_t lastSweep;  // last time idle connections were looked for
+	struct cache *cache;
+	struct upstreamPool *pool;
+	struct dnsCache *dns;
+	struct blacklist **blacklist;  // swapped whole on reload, see quiesceWorkers()
+	unsigned long passes;  // event loop iterations, a worker between two holds no reference to an old blacklist
+	int exited;  // set once its event loop has ended, on shutdown or a fatal error
+	volatile int *killed;
+	workerMetrics *metrics;  // written only by this worker
+	struct worker *workers;  // all of them, for the stats page
+	int workerCount;
+};
+
+struct worker *startWorkers(int count, int backend, const int *listenfds, int pinned, struct cache *cache,
+		struct upstreamPool *pool, struct dnsCache *dns, struct blacklist **blacklist, volatile int *killed);
+
+void quiesceWorkers(struct worker *workers, int count);
+
+void joinWorkers(struct worker *workers, int count);
+
+#endif //HTTPPROXY_WORKER_H